@@ -116,6 +116,116 @@ enum  {
         /* 11 */
         fork_server_dump_keys,
         fork_client_dump_keys,
+
+        /* 13 */
+        fork_configure_overlap_ratio,
+        fork_configure_overlap_ratio_rule,
+        /* only per pair: */
+        fork_configure_pair_decision,
+
+        /* 16 */
+        fork_configure_keymap_mods,
+        fork_configure_bypass_non_key,
+        /* only per key: */
+        fork_configure_key_bypass,
+
+        /* 19 */
+        fork_configure_streak_interval,
+        fork_configure_policy,
+
+        /* 21 */
+        fork_configure_learn_step,
+        fork_configure_learn_min,
+        fork_configure_learn_max,
+        fork_configure_learn_undo_key,
+
+        /* 25 */
+        fork_configure_max_hold,
+        fork_configure_max_queue,
+        fork_configure_force_fork,
+
+        /* 28 */
+        fork_configure_shadow,            /* config id, -1 = off */
+        /* read-only counters (set = reset all): */
+        fork_configure_shadow_compared,
+        fork_configure_shadow_disagreements,
+        fork_configure_shadow_latency,    /* ms, average (shadow - live) */
+
+        /* 32 */
+        fork_configure_force_on_motion,
+        fork_configure_force_on_button,
+        fork_configure_motion_threshold,  /* pixels */
+
+        /* 35 */
+        fork_configure_watchdog_frozen,   /* ms */
+        fork_configure_watchdog_queue,    /* events */
+        fork_configure_watchdog_shed,
+
+        /* 38, only per pair (selector, bucket), read-only (set = reset all): */
+        fork_configure_hold_histogram,    /* keycode */
+        fork_configure_outcome_histogram, /* fork_outcome_* (only presses) */
+        fork_configure_state_histogram,   /* 0 = st_suspect, 1 = st_verify */
+
+        /* 41, a command: reply with fork_machine_reply (data1: reset the
+         * counters after).  All the counters of the machine are there. */
+        fork_client_machine,
+
+        /* 42, only per pair (selector, bucket), read-only (set = reset all
+         * the histograms): how late the wakeups come, after the requested
+         * time. */
+        fork_configure_timer_histogram,   /* 0 = by the time passed, 1 = by the server clock */
+
+        /* 43 */
+        fork_configure_trace,             /* the binary trace ring, formatted when idle */
+        /* read-only counter (set = reset): */
+        fork_configure_trace_dropped,
+};
+
+
+/* The histograms have FORK_HISTOGRAM_BUCKETS buckets: 0 is for 0 ms, bucket
+ * B counts the times in [2^(B-1), 2^B) ms, the last one the longer ones. */
+#define FORK_HISTOGRAM_BUCKETS 16
+
+/* the selector of fork_configure_outcome_histogram: */
+enum {
+        fork_outcome_plain,       /* not a suspect */
+        fork_outcome_forked,
+        fork_outcome_not_forked,
+        fork_outcome_count
+};
+
+
+/* fork_configure_keymap_mods: instead of a mask of (real) modifiers, take
+ * those which only select the level in the keymap: the level3 & level5
+ * shifts.  (Not Shift: the clients bind its chords with the keys it doesn't
+ * change.)  And only the keys with a Shift level are judged. */
+#define FORK_KEYMAP_MODS_AUTO 0x100
+
+
+/* values for fork_configure_overlap_ratio_rule: */
+enum {
+        fork_ratio_none,
+        fork_ratio_before,        /* overlap relative to the time before the verificator */
+        fork_ratio_duration,      /* overlap relative to the verificator's press */
+};
+
+
+/* values for fork_configure_policy: how the keys pressed after the suspect
+ * decide. (Holding the suspect long enough, forks always.) */
+enum {
+        fork_policy_overlap,      /* a key overlaps long enough (overlap_limit, ratio) */
+        fork_policy_hold_on_other_press, /* any key pressed */
+        fork_policy_permissive_hold,     /* a key pressed and released */
+        fork_policy_tap_preferred,       /* never, only the total limit */
+        fork_policy_count
+};
+
+
+/* values for fork_configure_pair_decision: */
+enum {
+        fork_pair_wait,           /* as usual: decide by time & overlap */
+        fork_pair_fork,           /* the press of the 2nd key confirms the fork */
+        fork_pair_no_fork,        /* the press of the 2nd key refuses the fork */
 };
 
 
@@ -171,14 +281,42 @@ typedef struct _xforkGetLastKeys {
 
 
 
+/* How the event was decided (archived_event.reason). */
+enum {
+        reason_total,             // key pressed too long
+        reason_overlap,           // key press overlaps with another key
+        reason_force,             // mouse-button was pressed & triggered fork.
+        reason_ratio,             // the overlap is long relatively (`overlap_ratio')
+        reason_pair,              // the verificator's press (`pair_decision')
+        reason_press,             // another key pressed (policy)
+        reason_nested,            // another key pressed & released (policy)
+        reason_hold_limit,        // held longer than `max_hold'
+        reason_queue_limit,       // too many events held (`max_queue')
+        /* only non-forks: */
+        reason_release,           // the suspect released in time
+        reason_repeat,            // the suspect repeated (`fork_repeatable')
+        reason_keymap,            // the fork makes no difference in the keymap
+        reason_config,            // not forkable in the new configuration
+        /* not suspected: */
+        reason_repress,           // the .- trick (re-pressed quickly)
+        reason_streak,            // typing fast (`streak_interval')
+        reason_none,              // not a (forkable) press: passed through
+        reason_count
+};
+
+
 typedef struct
 {
    Time time;
    KeyCode key;
    KeyCode forked;
+   CARD8 reason;                /* reason_* */
+   CARD8 hold;                  /* the time in the plugin, as a histogram bucket
+                                 * (FORK_HISTOGRAM_BUCKETS): 0 = 0 ms, B = less
+                                 * than 2^B ms, the last one = longer */
    Bool press;                  /* client type? */
 } archived_event;
-/* 10 bytes? i guess 12! */
+/* 12 bytes: `reason' & `hold' use what was padding, `press' stays at 8. */
 
 typedef struct 
 {
@@ -186,4 +324,56 @@ typedef struct
    archived_event e[];
 } fork_events_reply;
 
+
+/* What the machine has been doing (fork_client_machine). */
+typedef struct
+{
+   CARD32 events_in;
+   CARD32 events_out;
+   CARD32 forks[reason_count];         /* by reason_* */
+   CARD32 non_forks[reason_count];
+   CARD32 forced;                      /* by the mouse, or a limit (see the
+                                        * reason_* of forks & non_forks) */
+   CARD32 dropped_repeats;             /* of forked keys */
+   CARD32 alloc_failures;              /* events dropped, or not archived */
+   CARD32 idle_steps;                  /* time steps with nothing to decide */
+   CARD32 wakeups;                     /* time steps, while a suspect was pending ... */
+   CARD32 premature_wakeups;           /* ... of them, the time decided nothing */
+   CARD32 max_input_queue;             /* the high-water marks */
+   CARD32 max_internal_queue;
+   CARD32 max_output_queue;
+   /* output: */
+   CARD32 output_batches;              /* runs handed over (events_out in all) */
+   CARD32 time_pushes;                 /* ProcessTime calls made ... */
+   CARD32 time_pushes_suppressed;      /* ... and avoided */
+   CARD32 thaws;                       /* handled ... */
+   CARD32 thaws_deferred;              /* ... and recorded, for the loop */
+   /* the watchdog: */
+   CARD32 watchdog_alarms;
+   CARD32 events_shed;
+   CARD32 max_frozen;                  /* ms */
+   /* by the mouse dispatcher: */
+   CARD32 mouse_calls;                 /* pointer events seen (while pending) ... */
+   CARD32 mouse_forces;                /* ... and they forced the fork */
+   CARD32 lock_collisions;             /* the mouse found the machine running */
+} fork_counters;
+
+
+/* ... and what it is doing now. */
+typedef struct
+{
+   CARD8 state;                        /* of the oldest suspect */
+   CARD8 suspect;                      /* the oldest one, or 0 */
+   CARD8 verificator;                  /* its first one, or 0 */
+   CARD8 suspects;                     /* how many pending */
+   CARD32 decision_time;               /* 0 = none */
+   CARD32 current_time;
+   CARD16 input_queue;
+   CARD16 internal_queue;
+   CARD16 output_queue;
+   CARD8 frozen;                       /* the next plugin */
+   CARD8 pad;
+   fork_counters counters;
+} fork_machine_reply;
+
 #endif
@@ -19,4 +19,9 @@
 
 #define STATIC_LAST 1
 
+// Static probes (see probes.h), set by configure if <sys/sdt.h> is found:
+#ifndef USE_PROBES
+#define USE_PROBES 0
+#endif
+
 #endif
@@ -8,6 +8,10 @@
 #include "fork.h"
 #include "fork_requests.h"
 #include "history.h"
+#include "shadow.h"
+#include "latency.h"
+#include "probes.h"
+#include "trace.h"
 
 /* something to define NULL */
 extern "C"
@@ -15,6 +19,7 @@ extern "C"
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <xorg/misc.h>
 }
 
@@ -63,6 +68,7 @@ machine_switch_config(PluginInstance* plugin, machineRec* machine,int id)
         //   |machine|  -> n 1 k2....n-1 -> n+1
 
         DB(("switching configs %d -> %d\n", machine->config->id, id));
+        PROBE_CONFIG_SWITCH(machine, machine->config->id, id);
 
         fork_configuration* new_current = *config_p;
 
@@ -86,6 +92,24 @@ machine_switch_config(PluginInstance* plugin, machineRec* machine,int id)
 }
 
 
+/* Run the config ID in the shadow (see shadow.h), or stop it, if ID < 0.
+ * Called by the machine (see adopt_published). */
+void
+machine_set_shadow(PluginInstance* plugin, machineRec* machine, int id)
+{
+   if (id < 0) {
+      machine_stop_shadow(plugin);
+      return;
+   }
+
+   fork_configuration** config_p = find_before_n(machine, id);
+   if (config_p && *config_p)
+      machine_start_shadow(plugin, *config_p);
+   else
+      ErrorF("%s: no config %d\n", __FUNCTION__, id);
+}
+
+
 static int config_counter = 0;
 
 
@@ -108,9 +132,28 @@ machine_new_config(void)
    }
 
    config->repeat_max = 80;
+   config->streak_interval = 0;
+   config->max_hold = 0;
+   config->max_queue = 0;
+   config->force_fork = TRUE;
+   config->watchdog_frozen = 0;
+   config->watchdog_queue = 0;
+   config->watchdog_shed = FALSE;
+   config->force_on_motion = TRUE;
+   config->force_on_button = FALSE;
+   config->motion_threshold = 0;
+   config->learn_step = 0;
+   config->learn_min = 30;
+   config->learn_max = 400;
+   config->learn_undo_key = 22; /* BackSpace */
    config->consider_forks_for_repeat = TRUE;
    config->debug = 1;        //  2
    config->clear_interval = 0;
+   config->overlap_ratio = 0;
+   config->overlap_ratio_rule = fork_ratio_none;
+   config->policy = fork_policy_overlap;
+   config->keymap_mods = 0;
+   config->bypass_non_key = FALSE;
 
    // use bzero!
    for (int i=0;i<256;i++) {
@@ -118,12 +161,14 @@ machine_new_config(void)
        for (int j=0;j<256;j++){         /* 1 ? */
            config->overlap_tolerance[i][j] = 0;
            config->verification_interval[i][j] = 0;
+           config->pair_decision[i][j] = fork_pair_wait;
        };
 
        config->fork_keycode[i] = 0;
        /*  config->forkCancel[i] = 0; */
        config->fork_repeatable[i] = FALSE;
        /* repetition is supported by default (not ignored)  True False*/
+       config->bypass_keycode[i] = FALSE;
    }
    /* ms: could be XkbDfltRepeatDelay */
 
@@ -133,7 +178,7 @@ machine_new_config(void)
 
 
    config->name = "default";
-   config->id = config_counter++;
+   config->id = __sync_fetch_and_add(&config_counter, 1);
    config->next = NULL;
    return config;
 }
@@ -161,6 +206,23 @@ machine_configure_twins (machineRec* machine, int type, KeyCode key, KeyCode twi
          machine->config->overlap_tolerance[key][twin] = value;
       else return machine->config->overlap_tolerance[key][twin];
       break;
+   case fork_configure_pair_decision:
+      if (set)
+         machine->config->pair_decision[key][twin] = value;
+      else return machine->config->pair_decision[key][twin];
+      break;
+
+   case fork_configure_hold_histogram:
+   case fork_configure_outcome_histogram:
+   case fork_configure_state_histogram:
+   case fork_configure_timer_histogram:
+      if (!machine->latency)
+         return 0;
+      if (set)
+         latency_reset(machine->latency);
+      else
+         return latency_histogram_count(machine->latency, type, key, twin);
+      break;
    }
    return 0;
 }
@@ -184,6 +246,11 @@ machine_configure_key (machineRec* machine, int type, KeyCode key, int value, Bo
             machine->config->fork_repeatable[key] = value;
          else return machine->config->fork_repeatable[key];
          break;
+      case fork_configure_key_bypass:
+         if (set)
+            machine->config->bypass_keycode[key] = value;
+         else return machine->config->bypass_keycode[key];
+         break;
       }
    return 0;
 }
@@ -219,6 +286,157 @@ machine_configure_global (PluginInstance* plugin, machineRec* machine, int type,
       else return machine->config->repeat_max;
       break;
 
+   case fork_configure_overlap_ratio:
+      if (set)
+         machine->config->overlap_ratio = value;
+      else return machine->config->overlap_ratio;
+      break;
+
+   case fork_configure_policy:
+      if (set)
+         machine->config->policy = value;
+      else return machine->config->policy;
+      break;
+
+   case fork_configure_streak_interval:
+      if (set)
+         machine->config->streak_interval = value;
+      else return machine->config->streak_interval;
+      break;
+
+   case fork_configure_max_hold:
+      if (set)
+         machine->config->max_hold = value;
+      else return machine->config->max_hold;
+      break;
+
+   case fork_configure_max_queue:
+      if (set)
+         machine->config->max_queue = value;
+      else return machine->config->max_queue;
+      break;
+
+   case fork_configure_force_fork:
+      if (set)
+         machine->config->force_fork = value;
+      else return machine->config->force_fork;
+      break;
+
+   case fork_configure_force_on_motion:
+      if (set)
+         machine->config->force_on_motion = value;
+      else return machine->config->force_on_motion;
+      break;
+
+   case fork_configure_force_on_button:
+      if (set)
+         machine->config->force_on_button = value;
+      else return machine->config->force_on_button;
+      break;
+
+   case fork_configure_motion_threshold:
+      if (set)
+         machine->config->motion_threshold = value;
+      else return machine->config->motion_threshold;
+      break;
+
+   case fork_configure_watchdog_frozen:
+      if (set)
+         machine->config->watchdog_frozen = value;
+      else return machine->config->watchdog_frozen;
+      break;
+
+   case fork_configure_watchdog_queue:
+      if (set)
+         machine->config->watchdog_queue = value;
+      else return machine->config->watchdog_queue;
+      break;
+
+   case fork_configure_watchdog_shed:
+      if (set)
+         machine->config->watchdog_shed = value;
+      else return machine->config->watchdog_shed;
+      break;
+
+   case fork_configure_trace:
+      if (set)
+         trace_set(plugin, value);
+      else return (machine->trace && machine->trace->on);
+      break;
+
+   case fork_configure_trace_dropped:
+      if (!machine->trace)
+         return 0;
+      // dropped_reported belongs to the block handler, so just move the base:
+      if (set)
+         machine->trace->dropped_base = machine->trace->dropped;
+      else
+         return machine->trace->dropped - machine->trace->dropped_base;
+      break;
+
+   case fork_configure_shadow:
+      if (set)
+         machine_set_shadow(plugin, machine, value);
+      else return (machine->shadow)? machine->shadow->machine->config->id : -1;
+      break;
+
+   case fork_configure_shadow_compared:
+   case fork_configure_shadow_disagreements:
+   case fork_configure_shadow_latency:
+      if (!machine->shadow)
+         return 0;
+      if (set)
+         shadow_reset_counters(machine->shadow);
+      else if (type == fork_configure_shadow_compared)
+         return machine->shadow->compared;
+      else if (type == fork_configure_shadow_disagreements)
+         return machine->shadow->disagreements;
+      else
+         return shadow_latency_difference(machine->shadow);
+      break;
+
+   case fork_configure_learn_step:
+      if (set)
+         machine->config->learn_step = value;
+      else return machine->config->learn_step;
+      break;
+
+   case fork_configure_learn_min:
+      if (set)
+         machine->config->learn_min = (value > 0)? value : 1;
+      else return machine->config->learn_min;
+      break;
+
+   case fork_configure_learn_max:
+      if (set)
+         machine->config->learn_max = value;
+      else return machine->config->learn_max;
+      break;
+
+   case fork_configure_learn_undo_key:
+      if (set)
+         machine->config->learn_undo_key = value;
+      else return machine->config->learn_undo_key;
+      break;
+
+   case fork_configure_bypass_non_key:
+      if (set)
+         machine->config->bypass_non_key = value;
+      else return machine->config->bypass_non_key;
+      break;
+
+   case fork_configure_keymap_mods:
+      if (set)
+         machine->config->keymap_mods = value;
+      else return machine->config->keymap_mods;
+      break;
+
+   case fork_configure_overlap_ratio_rule:
+      if (set)
+         machine->config->overlap_ratio_rule = value;
+      else return machine->config->overlap_ratio_rule;
+      break;
+
 
    case fork_configure_repeat_consider_forks:
       if (set)
@@ -251,7 +469,8 @@ machine_configure_global (PluginInstance* plugin, machineRec* machine, int type,
       break;
 
    case fork_server_dump_keys:
-      dump_last_events(plugin);
+      if (set)
+         dump_last_events(plugin);
       break;
 
       // mmc: this is special:
@@ -261,16 +480,18 @@ machine_configure_global (PluginInstance* plugin, machineRec* machine, int type,
       MDB(("fork_configure_switch: %d\n", value));
       machine_switch_config(plugin, machine, value);
       return 0;
+
+   case fork_client_machine:
+      // posted by machine_send_state:
+      if (set)
+         bzero(&machine->counters, sizeof(fork_counters));
+      break;
    }
 
    return 0;
 }
 
 
-// todo: make it inline functions
-#define subtype_n_args(t)   (t & 3)
-#define type_subtype(t)     (t >> 2)
-
 
 /* Return a value requested, or 0 on error.*/
 int
@@ -314,13 +535,29 @@ machine_configure_get(PluginInstance* plugin, int values[5], int return_config[3
 }
 
 
-/* Scan the DATA (of given length), and translate into configuration commands,
-   and execute on plugin's machine */
+/* A client request: the machine carries it out (machine_configure_now), at
+ * its next step. We never change the configuration under its hands. */
 int
 machine_configure(PluginInstance* plugin, int values[5])
 {
    assert (strcmp (PLUGIN_NAME(plugin), FORK_PLUGIN_NAME) == 0);
 
+   if (!machine_post_request(plugin, values)) {
+      ErrorF("%s: too many requests pending, dropping %d\n", __FUNCTION__,
+             values[0]);
+      return BadAlloc;
+   }
+   /* return client->noClientException; */
+   return 0;
+}
+
+
+/* Scan the DATA (of given length), and translate into configuration commands,
+   and execute on plugin's machine.  Only by the machine (see adopt_published),
+   or from inside it (learning). */
+int
+machine_configure_now(PluginInstance* plugin, const int values[5])
+{
    machineRec* machine = plugin_machine(plugin);
 
    int type = values[0];
@@ -349,6 +586,45 @@ machine_configure(PluginInstance* plugin, int values[5])
 }
 
 
+/* Reply with the counters, and a snapshot of the machine. It's read without
+ * the lock: the queue lengths and the suspect might be from different steps. */
+static int
+machine_send_state(ClientPtr client, PluginInstance* plugin, Bool reset)
+{
+   machineRec* machine = plugin_machine(plugin);
+   fork_machine_reply reply;
+
+   bzero(&reply, sizeof(reply));
+   reply.state = machine->state;
+   reply.suspects = machine->suspects_count;
+   if (machine->suspects_count > 0) {
+      fork_suspect* suspect = machine->suspects;
+      reply.suspect = suspect->suspect;
+      reply.verificator = (suspect->verificators_count > 0)?
+         suspect->verificators[0].key: 0;
+   }
+   reply.decision_time = (machine->decision_time == NO_DEADLINE)? 0:
+      machine->decision_time;
+   reply.current_time = machine->current_time;
+   reply.input_queue = machine->input_queue.length();
+   reply.internal_queue = machine->internal_queue.length();
+   reply.output_queue = machine->output_queue.length();
+   reply.frozen = plugin_frozen(plugin->next);
+   reply.counters = machine->counters;   /* fixme: BYTE SWAP if needed! */
+
+   if (reset) {
+      // the machine resets them itself:
+      int values[5] = {configure_type(fork_client_machine, 0), 0, 0, 0, 0};
+      machine_configure(plugin, values);
+   }
+
+   int r = xkb_plugin_send_reply(client, plugin, (char*) &reply, sizeof(reply));
+   if (r == 0)
+      return client->noClientException;
+   return r;
+}
+
+
 /*todo: int*/
 void
 machine_command(ClientPtr client, PluginInstance* plugin, int cmd, int data1,
@@ -361,6 +637,9 @@ machine_command(ClientPtr client, PluginInstance* plugin, int cmd, int data1,
       /* DB(("%s %d %.3s\n", __FUNCTION__, len, data)); */
       dump_last_events_to_client(plugin, client, data1);
       break;
+    case fork_client_machine:
+      machine_send_state(client, plugin, data1);
+      break;
     default:
       DB(("%s Unknown command!\n", __FUNCTION__));
       break;
@@ -13,8 +13,15 @@ extern "C" {
 // fixme: this needs to include ^^^
 #include "fork_requests.h"
 
+// The `type' of a configure request: the sub-OP-code & the number of operands.
+// todo: make it inline functions
+#define subtype_n_args(t)   (t & 3)
+#define type_subtype(t)     (t >> 2)
+#define configure_type(subtype, n_args)   (((subtype) << 2) | (n_args))
+
 int machine_configure_get(PluginInstance* plugin, int values[5], int return_config[3]);
 int machine_configure(PluginInstance* plugin, int values[5]);
+int machine_configure_now(PluginInstance* plugin, const int values[5]);
 void machine_command(ClientPtr client, PluginInstance* plugin, int cmd, int data1,
                      int data2, int data3, int data4);
 
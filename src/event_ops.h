@@ -1,4 +1,6 @@
 //
+#ifndef _EVENT_OPS_H_
+#define _EVENT_OPS_H_
 
 inline Bool
 release_p(const InternalEvent* event)
@@ -35,3 +37,5 @@ event_type_brief(InternalEvent *event)
     return (press_p(event)?"down":
             (release_p(event)?"up":"??"));
 }
+
+#endif
@@ -11,7 +11,7 @@
  *                                                |       \  step_by_force
  *   Accept_time  ->                              |
  *                                               restart
- *   mouse_call_back
+ *   mouse_dispatcher  -> force token + wakeup (of the machines with a pending suspect)
  *
  *   Thaw-notify:
  */
@@ -57,10 +57,16 @@
  *               ^ forked?
  *
  * We push at the end of input Q.  Then we pop from that Q and push on
- * Internal when we determine for 1 event, if forked/non-forked.
+ * Internal. Each forkable press there is a `suspect', with its own state
+ * (suspect/verify) and decision time; every later event is applied to all
+ * the pending suspects, so they are decided in parallel.
  *
- * Then we push on the output Q. At that moment, we also restart: all
- * from internal Q is returned/prepended to the input Q.
+ * Then we push on the output Q all the events up to the first undecided
+ * suspect. So the order of the events is never changed.
+ *
+ * Except for the `bypass' events (configured keycodes, non-key events):
+ * while a suspect is pending, they go directly on the output Q. They overtake
+ * the events in the internal Q, but never those on the output Q.
  */
 
 
@@ -70,6 +76,13 @@
 #include "configure.h"
 #include "history.h"
 #include "fork.h"
+#include "keymap.h"
+#include "policy.h"
+#include "learn.h"
+#include "shadow.h"
+#include "latency.h"
+#include "probes.h"
+#include "trace.h"
 
 
 extern "C" {
@@ -81,11 +94,24 @@ extern "C" {
 #include "event_ops.h"
 
 
-/* How we decided for the fork */
-enum {
-    reason_total,               // key pressed too long
-    reason_overlap,             // key press overlaps with another key
-    reason_force                // mouse-button was pressed & triggered fork.
+/* used only for debugging */
+char const *reason_description[]={
+    "total",
+    "overlap",
+    "force",
+    "ratio",
+    "pair",
+    "press",
+    "nested",
+    "hold limit",
+    "queue limit",
+    "release",
+    "repeat",
+    "keymap",
+    "config",
+    "re-press",
+    "streak",
+    "none"
 };
 
 /* used only for debugging */
@@ -129,15 +155,14 @@ const char* event_names[] = {
 size_t memory_balance = 0;
 
 
-const int BufferLength = 200;
 
-/* The returned string is in static space. Don't free it! */
+/* The returned string is in the MACHINE. Don't free it! */
 static const char*
-describe_key(DeviceIntPtr keybd, InternalEvent *event)
+describe_key(machineRec* machine, DeviceIntPtr keybd, InternalEvent *event)
 {
     assert (event);
 
-    static char buffer[BufferLength];
+    char* buffer = machine->key_buffer;
     XkbSrvInfoPtr xkbi= keybd->key->xkbInfo;
     KeyCode key = detail_of(event);
     // assert(0 <= key <= (max_key_code - min_key_code));
@@ -156,11 +181,11 @@ describe_key(DeviceIntPtr keybd, InternalEvent *event)
 }
 
 #if DEBUG
-/* the returned string is in static space. don't free it! */
+/* the returned string is in the MACHINE. don't free it! */
 static const char*
 describe_machine_state(machineRec* machine)
 {
-    static char buffer[BufferLength];
+    char* buffer = machine->state_buffer;
 
     snprintf(buffer, BufferLength, "%s[%dm%s%s",
              escape_sequence, 32 + machine->state,
@@ -180,18 +205,47 @@ hand_over_event_to_next_plugin(InternalEvent *event, PluginInstance* plugin)
     if (((machineRec*) plugin_machine(plugin))->config->debug) {
         DeviceIntPtr keybd = plugin->device;
         DB(("%s<<<", keysym_color));
-        DB(("%s", describe_key(keybd, event)));
+        DB(("%s", describe_key(plugin_machine(plugin), keybd, event)));
         DB(("%s\n", color_reset));
     }
 #endif
     assert (!plugin_frozen(next));
-    memory_balance -= event->any.length;
+    __sync_fetch_and_sub(&memory_balance, event->any.length);
     PluginClass(next)->ProcessEvent(next, event, TRUE); // we always own the event (up to now)
 }
 
 
+/* Push the time NOW to the next plugin, unless it has it already (and no
+ * event has been handed over since). */
+static void
+push_time_to_next(PluginInstance* plugin, Time now)
+{
+    machineRec* machine = plugin_machine(plugin);
+
+    if (now == machine->time_sent) {
+        machine->counters.time_pushes_suppressed++;
+        return;
+    }
+    machine->time_sent = now;
+    machine->counters.time_pushes++;
+
+    // this can thaw, freeze,?
+    UNLOCK(machine);
+    PluginClass(plugin->next)->ProcessTime(plugin->next, now);
+    LOCK(machine);
+}
+
+
 /* The machine is locked here:
- * Push as many as possible from the OUTPUT queue to the next layer */
+ * Push as many as possible from the OUTPUT queue to the next layer.
+ *
+ * The events are taken in runs (up to OUTPUT_BATCH), and handed over with
+ * the machine unlocked once per run. This saves only the unlocking &
+ * re-locking: the pipeline has no call for several events, so it's still 1
+ * ProcessEvent per event, and the next plugin may freeze after any of them
+ * (the rest of the run goes back to the queue). */
+#define OUTPUT_BATCH 32
+
 static void
 try_to_output(PluginInstance* plugin)
 {
@@ -202,21 +256,73 @@ try_to_output(PluginInstance* plugin)
     list_with_tail &queue = machine->output_queue;
     PluginInstance* next = plugin->next;
 
+    /* Called again, while handing over a run (from the next plugin): the
+     * outer call continues, in order. */
+    if (machine->delivering)
+        return;
+
     MDB(("%s: Queues: output: %d\t internal: %d\t input: %d \n", __FUNCTION__,
          queue.length (),
          machine->internal_queue.length (),
          machine->input_queue.length ()));
 
     while((!plugin_frozen(next)) && (!queue.empty ())) {
-        key_event* ev = queue.pop();
-
-        machine->last_events->push_back(make_archived_events(ev));
-        InternalEvent* event = ev->event;
-        mxfree(ev, sizeof(key_event));
+        key_event* batch[OUTPUT_BATCH];
+        archived_event* archived[OUTPUT_BATCH];
+        /* for the trace, written after re-locking: */
+        KeyCode keys[OUTPUT_BATCH];
+        unsigned char types[OUTPUT_BATCH];
+        int count = 0;
+
+        Time now = GetTimeInMillis();
+
+        while ((count < OUTPUT_BATCH) && !queue.empty()) {
+            batch[count] = queue.pop();
+            archived[count] = make_archived_events(batch[count], now);
+            keys[count] = detail_of(batch[count]->event);
+            types[count] = batch[count]->event->any.type;
+            count++;
+        }
 
+        machine->delivering = TRUE;
         UNLOCK(machine);
-        hand_over_event_to_next_plugin(event, plugin);
+        int delivered = 0;
+        while ((delivered < count) && !plugin_frozen(next)) {
+            key_event* ev = batch[delivered++];
+            if (machine->latency)
+                latency_note_output(machine->latency, ev, now);
+            PROBE_EVENT_OUT(machine, detail_of(ev->event), ev->event->any.type,
+                            now - ev->entered);
+            hand_over_event_to_next_plugin(ev->event, plugin);
+        }
         LOCK(machine);
+        machine->delivering = FALSE;
+
+        machine->counters.output_batches++;
+        machine->counters.events_out += delivered;
+        if (delivered)
+            machine->time_sent = 0;
+
+        for (int i = 0; i < delivered; i++) {
+            trace_note(machine, trace_event_out, keys[i], types[i], 0,
+                       now - batch[i]->entered);
+            if (archived[i])
+                machine->last_events->push_back(archived[i]);
+            else
+                machine->counters.alloc_failures++;
+            mxfree(batch[i], sizeof(key_event));
+        }
+
+        if (delivered < count) {
+            // the next plugin froze: return the rest to the front.
+            list_with_tail rest;
+            for (int i = delivered; i < count; i++) {
+                free(archived[i]);
+                rest.push(batch[i]);
+            }
+            rest.slice(queue);
+            queue.swap(rest);
+        }
     };
 
     // interesting: after handing over, the NEXT might need to be refreshed.
@@ -235,35 +341,13 @@ try_to_output(PluginInstance* plugin)
             now = machine->current_time;
         }
 
-        if (now) {
-            // this can thaw, freeze,?
-            UNLOCK(machine);
-            PluginClass(plugin->next)->ProcessTime(plugin->next, now);
-            LOCK(machine);
-        }
-        
+        if (now)
+            push_time_to_next(plugin, now);
     }
     if (!queue.empty ())
         MDB(("%s: still %d events to output\n", __FUNCTION__, queue.length ()));
 }
 
-// Another event has been determined. So:
-// todo:  possible emit a (notification) event immediately,
-// ... and push the event down the pipeline, when not frozen.
-static void
-output_event(key_event* ev, PluginInstance* plugin)
-{
-    assert(ev->event);
-    machineRec* machine = plugin_machine(plugin);
-    machine->output_queue.push(ev);
-    try_to_output(plugin);
-};
-
-
-/* note, that after this EV could point to a deallocated memory!
- * bad macro: evaluates EV twice. */
-#define EMIT_EVENT(ev) {output_event((ev), plugin); ev=NULL;}
-
 /**
  * Operations on the machine
  * fixme: should it include the `self_forked' keys ?
@@ -273,42 +357,27 @@ output_event(key_event* ev, PluginInstance* plugin)
 
 
 
-/* The Static state = configuration.
- * This is the matrix with some Time values:
- * using the fact, that valid KeyCodes are non zero, we use
- * the 0 column for `code's global values
-
- * Global      xxxxxxxx unused xxxxxx
- * key-wise   per-pair per-pair ....
- * key-wise   per-pair per-pair ....
- * ....
- */
-
-inline Time
-get_value_from_matrix (keycode_parameter_matrix matrix, KeyCode code, KeyCode verificator)
+/* The specific pair, or the verificator with any suspect, or the suspect
+ * with any verificator. */
+inline int
+pair_decision_of(fork_configuration* config, KeyCode code, KeyCode verificator)
 {
-    return (matrix[code][verificator]?
-            matrix[code][verificator]:
-            (matrix[code][0]?
-             matrix[code][0]: matrix[0][0]));
+    return (config->pair_decision[code][verificator]?
+            config->pair_decision[code][verificator]:
+            (config->pair_decision[0][verificator]?
+             config->pair_decision[0][verificator]: config->pair_decision[code][0]));
 }
 
-
-// note: depending on verificator is strange. There might be none!
-inline Time
-verification_interval_of(fork_configuration* config,
-                         KeyCode code, KeyCode verificator)
+/* Should EVENT skip the pending suspects? */
+inline Bool
+bypass_p(machineRec* machine, const InternalEvent* event)
 {
-    return get_value_from_matrix (config->verification_interval, code,
-                                  verificator);
-}
-
+    if (!(press_p(event) || release_p(event)))
+        return machine->config->bypass_non_key;
 
-inline Time
-overlap_tolerance_of(fork_configuration* config, KeyCode code,
-                     KeyCode verificator)
-{
-    return get_value_from_matrix (config->overlap_tolerance, code, verificator);
+    KeyCode key = detail_of(event);
+    /* a forked key has to be released in the proper order */
+    return (machine->config->bypass_keycode[key] && !machine->forkActive[key]);
 }
 
 inline Bool
@@ -329,175 +398,475 @@ key_forked(machineRec *machine, KeyCode code)
 }
 
 
+#define undecided_p(suspect) \
+    (((suspect)->state == st_suspect) || ((suspect)->state == st_verify))
+
+
 inline void
-change_state(machineRec* machine, state_type new_state)
+change_suspect_state(machineRec* machine, fork_suspect* suspect, state_type new_state)
 {
-    machine->state = new_state;
-    MDB((" --->%s[%dm%s%s\n", escape_sequence, 32 + new_state,
+    if (machine->latency) {
+        Time now = GetTimeInMillis();
+        if (undecided_p(suspect))
+            latency_note_state(machine->latency, suspect->state,
+                               now - suspect->state_since);
+        suspect->state_since = now;
+    }
+    PROBE_STATE(machine, suspect->suspect, suspect->state, new_state);
+    trace_note(machine, trace_state, suspect->suspect, suspect->state, new_state, 0);
+    suspect->state = new_state;
+    MDB((" %d --->%s[%dm%s%s\n", suspect->suspect, escape_sequence, 32 + new_state,
          state_description[new_state], color_reset));
 }
 
-void
-reverse_slice(list_with_tail &pre, list_with_tail &post)
+
+/* Recalculate the summary of the suspects: the machine `state' is the state
+ * of the oldest one, and we wait for the earliest decision_time. */
+static void
+update_machine_state(machineRec* machine)
 {
-    // Slice with a reversed semantic:
-    // A.slice(B) --> ()  (AB)
-    // traditional is (AB) ()
-    pre.slice(post);
-    pre.swap(post);
+    machine->state = (machine->suspects_count > 0)?
+        machine->suspects[0].state: st_normal;
+
+    machine->decision_time = NO_DEADLINE;
+    for (int i = 0; i < machine->suspects_count; i++) {
+        fork_suspect* suspect = machine->suspects + i;
+        if (undecided_p(suspect)
+            && (suspect->decision_time < machine->decision_time))
+            machine->decision_time = suspect->decision_time;
+    }
 }
 
-#define final_state_p(state)  ((state == st_deactivated) || (state == st_activated))
 
-inline void
-rewind_machine(machineRec* machine)
+/* The mouse dispatcher: a single DeviceEventCallback for all the machines.
+ * It runs on the main thread, the machines on the input thread.  So the
+ * machines (live & shadow) have a fixed slot here, for all their life: taken
+ * with CAS, emptied by the owner.  The dispatcher considers those with a
+ * pending suspect.  Before freeing a machine, its owner waits until no
+ * dispatcher can still see it (dispatcher_quiesce). */
+#define MAX_MACHINES 32
+
+static machineRec* volatile machines_registry[MAX_MACHINES];
+static volatile int machines_pending = 0; /* how many have `suspect_pending' */
+static volatile int dispatchers_running = 0;
+static int dispatcher_users = 0;   /* the machines alive: registered while > 0 */
+
+
+static void
+register_machine(machineRec* machine)
 {
-    assert (final_state_p(machine->state));
+    for (int i = 0; i < MAX_MACHINES; i++)
+        if (__sync_bool_compare_and_swap(&machines_registry[i], (machineRec*) NULL,
+                                         machine))
+            return;
+    ErrorF("%s: too many machines, the mouse will not force this one\n",
+           __FUNCTION__);
+}
 
-    /* reset the machine */
-    MDB(("== Resetting the fork machine (internal %d, input %d)\n",
-         machine->internal_queue.length (),
-         machine->input_queue.length ()));
 
-    change_state(machine,st_normal);
-    machine->verificator = 0;
+static void
+dispatcher_quiesce(void)
+{
+    __sync_synchronize();
+    while (dispatchers_running)
+        __sync_synchronize();
+}
+
 
-    if (!(machine->internal_queue.empty())) {
-        reverse_slice(machine->internal_queue, machine->input_queue);
-        MDB(("now in input_queue: %d\n", machine->input_queue.length ()));
+/* Take MACHINE off the registry: afterwards it can be freed. */
+static void
+unregister_machine(machineRec* machine)
+{
+    for (int i = 0; i < MAX_MACHINES; i++)
+        if (machines_registry[i] == machine) {
+            machines_registry[i] = NULL;
+            break;
+        }
+    dispatcher_quiesce();
+}
+
+
+static void
+set_suspect_pending(machineRec* machine, Bool pending)
+{
+    if (machine->suspect_pending == pending)
+        return;
+
+    if (pending) {
+        machine->pending_generation++;
+        __sync_fetch_and_add(&machines_pending, 1);
+    } else
+        __sync_fetch_and_sub(&machines_pending, 1);
+    machine->suspect_pending = pending;
+}
+
+
+static fork_suspect*
+add_suspect(machineRec* machine, key_event* ev)
+{
+    assert(machine->suspects_count < MAX_SUSPECTS);
+
+    fork_suspect* suspect = machine->suspects + machine->suspects_count++;
+    KeyCode key = detail_of(ev->event);
+
+    suspect->suspect = key;
+    suspect->suspect_time = time_of(ev->event);
+    suspect->verificators_count = 0;
+    suspect->decision_time = suspect->suspect_time +
+        verification_interval_of(machine->config, key, 0);
+    if (machine->config->max_hold
+        && (suspect->decision_time
+            > suspect->suspect_time + machine->config->max_hold))
+        suspect->decision_time = suspect->suspect_time + machine->config->max_hold;
+    suspect->ev = ev;
+    suspect->held_repeats = 0;
+    suspect->release_ev = NULL;
+    suspect->state = st_normal;
+    set_suspect_pending(machine, TRUE);
+    PROBE_SUSPECT(machine, key, suspect->suspect_time);
+
+    change_suspect_state(machine, suspect, st_suspect);
+    return suspect;
+}
+
+
+/* The oldest suspect has been decided, and its event released. */
+static void
+remove_head_suspect(machineRec* machine)
+{
+    assert(machine->suspects_count > 0);
+
+    machine->suspects_count--;
+    for (int i = 0; i < machine->suspects_count; i++)
+        machine->suspects[i] = machine->suspects[i + 1];
+    set_suspect_pending(machine, machine->suspects_count > 0);
+}
+
+
+/* The verificator selecting the (per-pair) verification_interval. */
+inline KeyCode
+first_verificator(fork_suspect* suspect)
+{
+    return (suspect->verificators_count > 0)? suspect->verificators[0].key: 0;
+}
+
+
+static fork_verificator*
+find_verificator(fork_suspect* suspect, KeyCode key)
+{
+    for (int i = 0; i < suspect->verificators_count; i++)
+        if (suspect->verificators[i].key == key)
+            return suspect->verificators + i;
+    return NULL;
+}
+
+
+/* Returns the new verificator, or NULL if the KEY is already one (or no space). */
+static fork_verificator*
+add_verificator(machineRec* machine, fork_suspect* suspect, KeyCode key, Time time)
+{
+    if (find_verificator(suspect, key))
+        return NULL;            // a (repeated) press of the verificator
+
+    if (suspect->verificators_count == MAX_VERIFICATORS) {
+        MDB(("%s: too many verificators, ignoring %d\n", __FUNCTION__, key));
+        return NULL;
     }
-};
 
+    fork_verificator* verificator = suspect->verificators + suspect->verificators_count++;
+    verificator->key = key;
+    verificator->time = time;
+    verificator->tolerance = overlap_tolerance_of(machine->config, suspect->suspect, key);
+    return verificator;
+}
 
-/* Fork the 1st element on the internal_queue. Remove it from the queue
- * and push to the output_queue.
- *
- * todo: Should I have a link back from machine to the plugin? Here useful!
- * todo:  do away with the `forked_key' argument --- it's useless!
- */
-inline void
-activate_fork(machineRec *machine, PluginInstance* plugin)
+
+/* Returns true if the KEY was a verificator. */
+static bool
+remove_verificator(fork_suspect* suspect, KeyCode key)
 {
-    list_with_tail &queue = machine->internal_queue;
-    assert(!queue.empty());
+    fork_verificator* verificator = find_verificator(suspect, key);
+    if (!verificator)
+        return false;
+
+    suspect->verificators_count--;
+    for (fork_verificator* end = suspect->verificators + suspect->verificators_count;
+         verificator < end; verificator++)
+        *verificator = *(verificator + 1);
+    return true;
+}
+
+
+static fork_suspect*
+find_undecided_suspect(machineRec* machine, KeyCode key)
+{
+    for (int i = 0; i < machine->suspects_count; i++) {
+        fork_suspect* suspect = machine->suspects + i;
+        if ((suspect->suspect == key) && undecided_p(suspect))
+            return suspect;
+    }
+    return NULL;
+}
+
 
-    key_event* ev = queue.pop();
+/* Is KEY the key of an undecided suspect older than SUSPECT? Its presses are
+ * then auto-repeats (see `held_repeats'), not verificators of SUSPECT. */
+static Bool
+held_by_older_suspect_p(machineRec* machine, const fork_suspect* suspect, KeyCode key)
+{
+    for (const fork_suspect* older = machine->suspects; older < suspect; older++)
+        if ((older->suspect == key) && undecided_p(older))
+            return TRUE;
+    return FALSE;
+}
 
-    KeyCode forked_key = detail_of(ev->event);
-    // assert (forked_key == machine->suspect)
 
-    /* change the keycode, but remember the original: */
-    ev->forked =  forked_key;
+/* Fork the suspect: change the keycode of its press (still in the
+ * internal_queue), but remember the original. */
+static void
+activate_fork(machineRec *machine, fork_suspect* suspect, int reason)
+{
+    key_event* ev = suspect->ev;
+    KeyCode forked_key = suspect->suspect;
+
+    ev->forked = forked_key;
+    ev->outcome = fork_outcome_forked;
+    ev->reason = reason;
+    machine->counters.forks[reason]++;
+    PROBE_DECISION(machine, forked_key, 1, reason,
+                   machine->current_time - suspect->suspect_time);
+    trace_note(machine, trace_decision, forked_key, 1, reason,
+               machine->current_time - suspect->suspect_time);
     machine->forkActive[forked_key] =
         ev->event->device_event.detail.key = machine->config->fork_keycode[forked_key];
+    if (suspect->release_ev) {
+        // already released (fork_ratio_duration): so is the fork.
+        suspect->release_ev->event->device_event.detail.key =
+            machine->forkActive[forked_key];
+        machine->forkActive[forked_key] = 0;
+    }
 
-    change_state(machine, st_activated);
-    MDB(("%s suspected: %d-> forked to: %d,  internal queue is long: %d, %s\n", __FUNCTION__,
+    suspect->decision_time = NO_DEADLINE;
+    suspect->reason = reason;
+    change_suspect_state(machine, suspect, st_activated);
+    // we are using the modifier, not typing a streak.
+    machine->last_plain_press_time = 0;
+    MDB(("%s suspected: %d-> forked to: %d (by %s),  internal queue is long: %d\n",
+         __FUNCTION__,
          forked_key,
          machine->config->fork_keycode[forked_key],
-         machine->internal_queue.length (),
-         describe_machine_state(machine)));
-    rewind_machine(machine);
-
-    EMIT_EVENT(ev);
+         reason_description[reason],
+         machine->internal_queue.length ()));
 }
 
 
-/*
- * Called by mouse button press processing.
- * Make all the forkable (pressed)  forked! (i.e. confirm them all)
- *
- * If in Suspect or Verify state, force the fork. (todo: should be configurable)
- */
+// so the suspect is not forked.
 static void
-step_fork_automaton_by_force(machineRec *machine, PluginInstance* plugin)
+deactivate_fork(machineRec *machine, fork_suspect* suspect, int reason)
 {
-    if (machine->state == st_normal) {
-        return;
-    }
-    if (machine->state == st_deactivated) {
-        ErrorF("%s: BUG.\n", __FUNCTION__);
-        return;
-    }
-
-    if (machine->internal_queue.empty())
-        return;
-
-    /* so, the state is one of: verify, suspect or activated. */
-    list_with_tail& queue = machine->internal_queue;
+    suspect->decision_time = NO_DEADLINE;
+    suspect->reason = reason;
+    suspect->ev->outcome = fork_outcome_not_forked;
+    suspect->ev->reason = reason;
+    machine->counters.non_forks[reason]++;
+    PROBE_DECISION(machine, suspect->suspect, 0, reason,
+                   machine->current_time - suspect->suspect_time);
+    trace_note(machine, trace_decision, suspect->suspect, 0, reason,
+               machine->current_time - suspect->suspect_time);
+    change_suspect_state(machine, suspect, st_deactivated);
+    if (suspect->suspect_time > machine->last_plain_press_time)
+        machine->last_plain_press_time = suspect->suspect_time;
+    MDB(("this is not a fork! %d\n", suspect->suspect));
+}
 
-    MDB(("%s%s%s state: %s, queue: %d .... FORCE\n",
-         fork_color, __FUNCTION__, color_reset,
-         describe_machine_state(machine),
-         queue.length ()));
 
-    machine->decision_time = 0;
-    activate_fork(machine, plugin);
+/* Record the high-water MARK of a queue, now LENGTH long. */
+inline void
+note_queue_length(CARD32& mark, int length)
+{
+    if ((CARD32) length > mark)
+        mark = length;
 }
 
+
 static void
 do_enqueue_event(machineRec *machine, key_event *ev)
 {
     machine->internal_queue.push(ev);
+    note_queue_length(machine->counters.max_internal_queue,
+                      machine->internal_queue.length());
     // when replaying no need to show this:
     // MDB(("enqueue_event: time left: %u\n", machine->decision_time));
 }
 
-// so the ev proves, that the current event is not forked.
+
+static void
+free_key_event(key_event *ev)
+{
+    mxfree(ev->event, ev->event->any.length);
+    mxfree(ev, sizeof(key_event));
+}
+
+
+/* Move the events, which are not preceded by an undecided suspect, from the
+ * internal_queue to the output_queue, and try to push them further. */
 static void
-do_confirm_non_fork_by(machineRec *machine, key_event *ev,
-                       PluginInstance* plugin)
+release_decided_events(machineRec* machine, PluginInstance* plugin)
+{
+    list_with_tail &queue = machine->internal_queue;
+    Bool released = FALSE;
+
+    while (!queue.empty()) {
+        key_event* ev = (key_event*) queue.front();
+
+        if ((machine->suspects_count > 0) && (machine->suspects[0].ev == ev)) {
+            fork_suspect* head = machine->suspects;
+
+            if (undecided_p(head))
+                break;
+            if (head->state == st_activated)
+                machine->drop_repeats[head->suspect] += head->held_repeats;
+            remove_head_suspect(machine);
+        } else if (press_p(ev->event) && !ev->forked
+                   && machine->drop_repeats[detail_of(ev->event)]) {
+            // repeated press of a key which (in the meantime) forked:
+            MDB(("%s: the key is forked, ignoring\n", __FUNCTION__));
+            machine->drop_repeats[detail_of(ev->event)]--;
+            machine->counters.dropped_repeats++;
+            queue.pop();
+            free_key_event(ev);
+            continue;
+        }
+        queue.pop();
+        if (machine->shadow)
+            shadow_note_decided(machine, ev);
+        machine->output_queue.push(ev);
+        note_queue_length(machine->counters.max_output_queue,
+                          machine->output_queue.length());
+        released = TRUE;
+    }
+
+    update_machine_state(machine);
+    if (released)
+        try_to_output(plugin);
+}
+
+
+/* The force channel (see `force_posted'). */
+inline void
+post_force_token(machineRec* machine)
 {
-    assert(machine->decision_time == 0);
-    change_state(machine, st_deactivated);
-    machine->internal_queue.push(ev); //  this  will be re-processed!!
+    __sync_synchronize();
+    machine->force_posted++;
+}
 
 
-    key_event* non_forked_event = machine->internal_queue.pop();
-    MDB(("this is not a fork! %d\n", detail_of(non_forked_event->event)));
-    rewind_machine(machine);
+inline Bool
+take_force_token(machineRec* machine)
+{
+    if (machine->force_taken == machine->force_posted)
+        return FALSE;
+    __sync_synchronize();
+    machine->force_taken++;
+    return TRUE;
+}
+
 
-    EMIT_EVENT(non_forked_event);
+/* Decide the SUSPECT now. The mouse (reason_force) forks, the limits decide
+ * as configured by `force_fork'. */
+static void
+force_decision(machineRec *machine, fork_suspect* suspect, int reason)
+{
+    machine->counters.forced++;
+    PROBE_FORCE(machine, suspect->suspect, reason);
+    trace_note(machine, trace_force, suspect->suspect, 0, reason, 0);
+    if ((reason == reason_force) || machine->config->force_fork)
+        activate_fork(machine, suspect, reason);
+    else
+        deactivate_fork(machine, suspect, reason);
 }
 
-// so EV confirms fork of the current event.
+
+/*
+ * Called by mouse button press processing, and when a limit is exceeded.
+ * Make all the forkable (pressed)  forked! (i.e. confirm them all)
+ *
+ * If in Suspect or Verify state, force the decision (see force_decision).
+ * Only the oldest suspect is forced, the following are decided as usual.
+ */
 static void
-do_confirm_fork(machineRec *machine, key_event *ev, PluginInstance* plugin)
+step_fork_automaton_by_force(machineRec *machine, PluginInstance* plugin,
+                             int reason)
 {
-    machine->decision_time = 0;
+    if (machine->suspects_count == 0) {
+        return;
+    }
 
-    /* fixme: ev is the just-read event. But that is surely not the head
-       of queue (which is confirmed to fork) */
-    MDB(("confirm:\n"));
-    machine->internal_queue.push(ev);
-    activate_fork(machine, plugin);
+    fork_suspect* suspect = machine->suspects;
+    if (!undecided_p(suspect)) {
+        ErrorF("%s: BUG.\n", __FUNCTION__);
+        return;
+    }
+
+    MDB(("%s%s%s state: %s, queue: %d .... FORCE\n",
+         fork_color, __FUNCTION__, color_reset,
+         describe_machine_state(machine),
+         machine->internal_queue.length ()));
+
+    force_decision(machine, suspect, reason);
+    release_decided_events(machine, plugin);
 }
 
+
 /*
   returns:
-  state  (in the `machine')
-  output_event   possibly, othewise 0
-  machine->decision_time   ... for another timer.
+  state  (in the `suspect')
+  suspect->decision_time   ... for another timer.
 */
 
 #define time_difference_less(start,end,difference)   (end < (start + difference))
 #define time_difference_more(start,end,difference)   (end > (start + difference))
 
 
+/* Has the SUSPECT been held longer than `max_hold'? */
+inline Bool
+hold_limit_p(machineRec *machine, fork_suspect* suspect, Time current_time)
+{
+    return (machine->config->max_hold
+            && (current_time - suspect->suspect_time)
+            >= (Time) machine->config->max_hold);
+}
+
+
+/* Too many events held? */
+inline Bool
+queue_limit_p(machineRec *machine)
+{
+    return (machine->config->max_queue
+            && (machine->suspects_count > 0)
+            && (machine->internal_queue.length() + machine->input_queue.length()
+                > machine->config->max_queue));
+}
+
+
 // return 0 ... elapsed, or time when will happen
+// The `max_hold' is not checked, but the time returned is bounded by it.
 Time
-key_pressed_too_long(machineRec *machine, Time current_time)
+key_pressed_too_long(machineRec *machine, fork_suspect* suspect, Time current_time)
 {
     int verification_interval =
         verification_interval_of(machine->config,
-                                 machine->suspect,
+                                 suspect->suspect,
                                  // this can be 0 (& should be, unless)
-                                 machine->verificator);
-    Time decision_time = machine->suspect_time + verification_interval;
+                                 first_verificator(suspect));
+    if (machine->config->max_hold
+        && (verification_interval > machine->config->max_hold))
+        verification_interval = machine->config->max_hold;
+    Time decision_time = suspect->suspect_time + verification_interval;
 
     MDB(("time: verification_interval = %dms elapsed so far =%dms\n",
          verification_interval,
-         (int)(current_time - machine->suspect_time)));
+         (int)(current_time - suspect->suspect_time)));
 
     if (decision_time <= current_time)
         return 0;
@@ -506,75 +875,102 @@ key_pressed_too_long(machineRec *machine, Time current_time)
 }
 
 
-// return 0 if enough, otherwise the time when it will be enough/proving a fork.
-Time
-key_pressed_in_parallel(machineRec *machine, Time current_time)
+/* Carry out the decision of the policy. Returns true if decided. */
+static bool
+apply_policy_decision(machineRec* machine, fork_suspect* suspect,
+                      policy_decision decision, int reason, Time time)
 {
-    // verify overlap
-    int overlap_tolerance = overlap_tolerance_of(machine->config,
-                                                 machine->suspect,
-                                                 machine->verificator);
-    Time decision_time =  machine->verificator_time + overlap_tolerance;
-
-    if (decision_time <= current_time) {
-        return 0;
-    } else {
-        MDB(("time: overlay interval = %dms elapsed so far =%dms\n",
-             overlap_tolerance,
-             (int) (current_time - machine->verificator_time)));
-
-        MDB(("suspected = %d, verificator %d. Times: overlap %d, "
-             "still needed: %u (ms)\n", machine->suspect, machine->verificator,
-             current_time - machine->verificator_time,
-             decision_time - current_time));
-
-        return decision_time;
+    switch (decision) {
+        case policy_fork:
+            learn_decided(machine, suspect, TRUE, reason, time);
+            activate_fork(machine, suspect, reason);
+            return true;
+        case policy_no_fork:
+            learn_decided(machine, suspect, FALSE, reason, time);
+            deactivate_fork(machine, suspect, reason);
+            return true;
+        default:
+            return false;
     }
 }
 
 
+/* Returns true if it decided the SUSPECT. Otherwise sets its decision_time. */
 static bool
-step_fork_automaton_by_time(machineRec *machine, PluginInstance* plugin,
-                            Time current_time)
+step_suspect_by_time(machineRec *machine, fork_suspect* suspect, Time current_time)
 {
     // confirm fork:
-    int reason;
-    MDB(("%s%s%s state: %s, queue: %d, time: %u key: %d\n",
-         fork_color, __FUNCTION__, color_reset,
-         describe_machine_state (machine),
-         machine->internal_queue.length (), (int)current_time,
-         machine->suspect));
+    int reason = reason_overlap;
+
+    if (hold_limit_p(machine, suspect, current_time)) {
+        force_decision(machine, suspect, reason_hold_limit);
+        return true;
+    }
+
+    /* Released: only the verificators' releases can fork, until the
+     * decision_time (see fork_ratio_release_deadline). */
+    if (suspect->release_ev) {
+        if (current_time < suspect->decision_time)
+            return false;
+        learn_decided(machine, suspect, FALSE, reason_ratio, current_time);
+        deactivate_fork(machine, suspect, reason_ratio);
+        return true;
+    }
 
     /* First, I try the simple (fork-by-one-keys).
-     * If that works, -> fork! Otherwise, I try w/ 2-key forking, overlapping.
+     * If that works, -> fork! Otherwise, the policy judges the verificators
+     * (e.g. their overlap).
      */
-
-    if (0 == (machine->decision_time =
-              key_pressed_too_long(machine, current_time))) {
-        reason = reason_total;
-        activate_fork(machine, plugin);
+    if (0 == (suspect->decision_time =
+              key_pressed_too_long(machine, suspect, current_time))) {
+        learn_decided(machine, suspect, TRUE, reason_total, current_time);
+        activate_fork(machine, suspect, reason_total);
         return true;
     };
 
     /* To test 2 keys overlap, we need the 2nd key: a verificator! */
-    if (machine->state == st_verify) {
-        // verify overlap
-        Time decision_time = key_pressed_in_parallel(machine, current_time);
+    if (suspect->state == st_verify) {
+        Time decision_time = NO_DEADLINE;
+        policy_decision decision =
+            fork_policy_of(machine->config)->by_time(machine, suspect, current_time,
+                                                     &decision_time, &reason);
 
-        if (decision_time == 0) {
-            reason = reason_overlap;
-            activate_fork(machine, plugin);
+        if (apply_policy_decision(machine, suspect, decision, reason, current_time))
             return true;
-        }
 
-        if (decision_time < machine->decision_time)
-            machine->decision_time = decision_time;
+        if (decision_time < suspect->decision_time)
+            suspect->decision_time = decision_time;
+    }
+    return false;
+}
+
+
+static bool
+step_fork_automaton_by_time(machineRec *machine, PluginInstance* plugin,
+                            Time current_time)
+{
+    bool decided = false;
+    MDB(("%s%s%s state: %s, queue: %d, time: %u suspects: %d\n",
+         fork_color, __FUNCTION__, color_reset,
+         describe_machine_state (machine),
+         machine->internal_queue.length (), (int)current_time,
+         machine->suspects_count));
+
+    for (int i = 0; i < machine->suspects_count; i++) {
+        fork_suspect* suspect = machine->suspects + i;
+        if (undecided_p(suspect)
+            && step_suspect_by_time(machine, suspect, current_time))
+            decided = true;
     }
-    // so, now we are surely in the replay_mode. All we need is to
-    // get an estimate on time still needed:
 
+    if (decided) {
+        release_decided_events(machine, plugin);
+        return true;
+    }
 
+    update_machine_state(machine);
     /* So, we were woken too early. */
+    machine->counters.premature_wakeups++;
     MDB(("*** %s: returning with some more time-to-wait: %u"
          "(prematurely woken)\n", __FUNCTION__,
          machine->decision_time - current_time));
@@ -585,10 +981,23 @@ step_fork_automaton_by_time(machineRec *machine, PluginInstance* plugin,
 #define MOUSE_EMULATION_ON(xkb) (xkb->ctrls->enabled_ctrls & XkbMouseKeysMask)
 
 
-/** apply_event_to_{STATE} */
+/* Are we typing fast, i.e. the previous non-forked press is recent? */
+inline Bool
+typing_streak_p(machineRec *machine, Time time)
+{
+    return (machine->config->streak_interval
+            && machine->last_plain_press_time
+            && (time - machine->last_plain_press_time)
+            < (Time) machine->config->streak_interval);
+}
+
 
+/** apply_event_to_{STATE} */
 
 
+/* Every event (not discarded by the suspects) passes here, in the order
+ * of arrival, and is appended to the internal_queue. A forkable press
+ * becomes a new suspect. */
 static void
 apply_event_to_normal(machineRec *machine, key_event *ev, PluginInstance* plugin)
 {
@@ -602,14 +1011,13 @@ apply_event_to_normal(machineRec *machine, key_event *ev, PluginInstance* plugin
     fork_configuration* config = machine->config;
     XkbDescPtr xkb = xkbi->desc;
 
-    assert(machine->internal_queue.empty());
-
     // if this key might start a fork....
     if (press_p(event) && forkable_p(config, key)
         /* fixme: is this w/ 1-event precision? (i.e. is the xkb-> updated synchronously) */
         /* todo:  does it have a mouse-related action? */
         && !(MOUSE_EMULATION_ON(xkb))) {
         /* Either suspect, or detect .- trick to suppress fork */
+        fork_suspect* pending = find_undecided_suspect(machine, key);
 
         /* .- trick: by depressing/re-pressing the key rapidly, fork is disabled,
          * and AR is invoked */
@@ -619,27 +1027,32 @@ apply_event_to_normal(machineRec *machine, key_event *ev, PluginInstance* plugin
                   (int)(simulated_time - machine->last_released_time), config->repeat_max));
         }
 #endif
-        /* So, unless we see the .- trick, we do suspect: */
-        if (!key_forked(machine, key) &&
+        if (pending) {
+            /* Auto-repeat of a suspect, which is still being verified. If it
+             * forks, these presses will be ignored. */
+            MDB(("repeating the suspect %d\n", key));
+            pending->held_repeats++;
+        } else if (!key_forked(machine, key) && typing_streak_p(machine, simulated_time)) {
+            MDB(("typing streak: %d ms since the last press, not suspecting\n",
+                 (int)(simulated_time - machine->last_plain_press_time)));
+            // self-forked, as the .- trick:
+            machine->forkActive[key] = key;
+            ev->reason = reason_streak;
+            machine->last_plain_press_time = simulated_time;
+        } else if (!key_forked(machine, key) &&
             ((machine->last_released != key ) ||
              /*todo: time_difference_more(machine->last_released_time,simulated_time,
               * config->repeat_max) */
              (simulated_time - machine->last_released_time) >
              (Time) config->repeat_max)) {
-            /* Emacs indenting bug: */
-            change_state(machine, st_suspect);
-            machine->suspect = key;
-            machine->suspect_time = time_of(event);
-            machine->decision_time = machine->suspect_time +
-                verification_interval_of(machine->config, key, 0);
-            do_enqueue_event(machine, ev);
-            return;
+            /* So, unless we see the .- trick, we do suspect: */
+            add_suspect(machine, ev);
         } else {
             // .- trick: (fixme: or self-forked)
             MDB(("re-pressed very quickly\n"));
             machine->forkActive[key] = key; // fixme: why??
-            EMIT_EVENT(ev);
-            return;
+            ev->reason = reason_repress;
+            machine->last_plain_press_time = simulated_time;
         };
     } else if (release_p(event) && (key_forked(machine, key))) {
         MDB(("releasing forked key\n"));
@@ -663,106 +1076,151 @@ apply_event_to_normal(machineRec *machine, key_event *ev, PluginInstance* plugin
         // this is the state (of the keyboard, not the machine).... better to
         // say of the machine!!!
         machine->forkActive[key] = 0;
-        EMIT_EVENT(ev);
     } else {
         if (release_p (event)) {
             machine->last_released = detail_of(event);
             machine->last_released_time = time_of(event);
+        } else if (press_p (event)) {
+            machine->last_plain_press_time = simulated_time;
         };
         // pass along the un-forkable event.
-        EMIT_EVENT(ev);
     };
+    do_enqueue_event(machine, ev);
 };
 
 
 
-/*  First (press)
- *  Second    <-- we are here.
- */
-static void
-apply_event_to_suspect(machineRec *machine, key_event *ev,
-                       PluginInstance* plugin)
+/* The press of KEY might decide the SUSPECT immediately.
+ * Returns true if decided. */
+static bool
+decide_by_pair(machineRec *machine, fork_suspect* suspect, KeyCode key)
 {
-    InternalEvent* event = ev->event;
-    Time simulated_time = time_of(event);
-    KeyCode key = detail_of(event);
-
-    list_with_tail &queue = machine->internal_queue;
+    // the shadow uses the live analysis (made for the live `keymap_mods'):
+    const keymap_analysis* keymap =
+        (machine->shadow_p? machine->shadow->live->keymap : machine->keymap);
 
-    /* Here, we can
-     * o refuse .... if suspected/forkable is released quickly,
-     * o fork (definitively),  ... for _time_
-     * o start verifying, or wait, or confirm (timeout)
+    switch (pair_decision_of(machine->config, suspect->suspect, key)) {
+        case fork_pair_fork:
+            activate_fork(machine, suspect, reason_pair);
+            return true;
+        case fork_pair_no_fork:
+            MDB(("%d after %d: never a fork\n", key, suspect->suspect));
+            deactivate_fork(machine, suspect, reason_pair);
+            return true;
+        default:
+            if (machine->config->keymap_mods && keymap
+                && keymap_no_fork_p(keymap,
+                                    machine->config->fork_keycode[suspect->suspect],
+                                    key)) {
+                MDB(("%d after %d: the fork makes no difference in the keymap\n",
+                     key, suspect->suspect));
+                deactivate_fork(machine, suspect, reason_keymap);
+                return true;
+            }
+            return false;
+    }
+}
+
+
+/* KEY has been pressed after the SUSPECT: a new verificator. The policy
+ * might decide, otherwise recalculate the decision_time. */
+static void
+verificator_pressed(machineRec* machine, fork_suspect* suspect, KeyCode key, Time time)
+{
+    // a held key cannot verify the younger suspects (step_fork_automaton_by_key):
+    assert(!held_by_older_suspect_p(machine, suspect, key));
+
+    fork_verificator* verificator = add_verificator(machine, suspect, key, time);
+    int reason = reason_overlap;
+
+    if (!verificator)
+        return;
+
+    policy_decision decision =
+        fork_policy_of(machine->config)->verificator_pressed(machine, suspect,
+                                                             verificator, &reason);
+    if (!apply_policy_decision(machine, suspect, decision, reason, time))
+        step_suspect_by_time(machine, suspect, time);
+}
+
+
+/*  First (press)
+ *  Second    <-- we are here.
+ *
+ * Returns TRUE if the event should be discarded.
+ */
+static Bool
+apply_event_to_suspect(machineRec *machine, fork_suspect* suspect, key_event *ev)
+{
+    InternalEvent* event = ev->event;
+    Time simulated_time = time_of(event);
+    KeyCode key = detail_of(event);
+
+    /* Here, we can
+     * o refuse .... if suspected/forkable is released quickly,
+     * o fork (definitively),  ... for _time_
+     * o start verifying, or wait, or confirm (timeout)
      * todo: I should repeat a bi-depressed forkable.
      */
-    assert(!queue.empty() && machine->state == st_suspect);
+    assert(suspect->state == st_suspect);
+
+    if (hold_limit_p(machine, suspect, simulated_time)) {
+        force_decision(machine, suspect, reason_hold_limit);
+        return FALSE;
+    }
 
     // todo: check the ranges (long vs. int)
-    if ((machine->decision_time =
-         key_pressed_too_long(machine, simulated_time)) == 0) {
-        do_confirm_fork(machine, ev, plugin);
-        return;
+    if ((suspect->decision_time =
+         key_pressed_too_long(machine, suspect, simulated_time)) == 0) {
+        learn_decided(machine, suspect, TRUE, reason_total, simulated_time);
+        activate_fork(machine, suspect, reason_total);
+        return FALSE;
     };
 
     /* So, we now have a second key, since the duration of 1 key
      * was not enough. */
     if (release_p(event)) {
         MDB(("suspect/release: suspected = %d, time diff: %d\n",
-             machine->suspect, (int)(simulated_time  -  machine->suspect_time)));
-        if (key == machine->suspect) {
-            machine->decision_time = 0; // might be useless!
-            do_confirm_non_fork_by(machine, ev, plugin);
-            return;
+             suspect->suspect, (int)(simulated_time  -  suspect->suspect_time)));
+        if (key == suspect->suspect) {
+            learn_decided(machine, suspect, FALSE, reason_release, simulated_time);
+            deactivate_fork(machine, suspect, reason_release);
             /* fixme:  here we confirm, that it was not a user error.....
                bad synchro. i.e. the suspected key was just released  */
-        } else {
-            /* something released, but not verificating, b/c we are in `suspect',
-             * not `confirm'  */
-            do_enqueue_event(machine, ev); // the `key'
-            return;
-        };
-    } else {
-        if (!press_p (event)) {
-            // RawPress & Device events.
-            do_enqueue_event(machine,ev);
-            return;
         }
+        /* otherwise something released, but not verificating, b/c we are in
+         * `suspect', not `confirm'  */
+        return FALSE;
+    }
 
-        if (key == machine->suspect) {
-            /* How could this happen? Auto-repeat on the lower/hw level?
-             * And that AR interval is shorter than the fork-verification */
-            if (machine->config->fork_repeatable[key]) {
-                MDB(("The suspected key is configured to repeat, so ...\n"));
-                machine->forkActive[machine->suspect] = machine->suspect;
-                machine->decision_time = 0;
-                do_confirm_non_fork_by(machine, ev, plugin);
-                return;
-            } else {
-                // fixme: this keycode is repeating, but we still don't know what to do.
-                // ..... `discard' the event???
-                // fixme: but we should recalc the decision_time !!
-                return;
-            }
-        } else {
-            // another key pressed
-            change_state(machine,st_verify);
-            machine->verificator_time = simulated_time;
-            machine->verificator = key; /* if already we had one -> we are not in this state!
-                                           if the verificator becomes a modifier ?? fixme:*/
-            // verify overlap
-            Time decision_time = key_pressed_in_parallel(machine, simulated_time);
-
-            // well, this is an abuse ... this should never be 0.
-            if (decision_time == 0) {
-                MDB(("absurd\n")); // this means that verificator key verifies immediately!
-            }
-            if (decision_time < machine->decision_time)
-                machine->decision_time = decision_time;
+    if (!press_p (event)) {
+        // RawPress & Device events.
+        return FALSE;
+    }
 
-            do_enqueue_event(machine, ev);
-            return;
-        };
+    if (key == suspect->suspect) {
+        /* How could this happen? Auto-repeat on the lower/hw level?
+         * And that AR interval is shorter than the fork-verification */
+        if (machine->config->fork_repeatable[key]) {
+            MDB(("The suspected key is configured to repeat, so ...\n"));
+            machine->forkActive[suspect->suspect] = suspect->suspect;
+            deactivate_fork(machine, suspect, reason_repeat);
+            return FALSE;
+        } else {
+            // fixme: this keycode is repeating, but we still don't know what to do.
+            // ..... `discard' the event???
+            return TRUE;
+        }
     }
+
+    // another key pressed
+    if (decide_by_pair(machine, suspect, key))
+        return FALSE;
+
+    change_suspect_state(machine, suspect, st_verify);
+    /* if the verificator becomes a modifier ?? fixme:*/
+    verificator_pressed(machine, suspect, key, simulated_time);
+    return FALSE;
 }
 
 
@@ -773,10 +1231,10 @@ apply_event_to_suspect(machineRec *machine, key_event *ev,
  * ???? how long?
  * second Released.
  * So, already 2 keys have been pressed, and still no decision.
- * Now we have the 3rd key.
+ * Now we have the 3rd key: it becomes another verificator, if pressed.
  *  We wait only for time, and for the release of the key */
 static void
-apply_event_to_verify(machineRec *machine, key_event *ev, PluginInstance* plugin)
+apply_event_to_verify(machineRec *machine, fork_suspect* suspect, key_event *ev)
 {
     InternalEvent* event = ev->event;
     Time simulated_time = time_of(event);
@@ -807,49 +1265,69 @@ apply_event_to_verify(machineRec *machine, key_event *ev, PluginInstance* plugin
        are slow to release, when we press a specific one afterwards. So in this case fork slower!
     */
 
-    if ((machine->decision_time = key_pressed_too_long(machine, simulated_time)) == 0)
-    {
-        do_confirm_fork(machine, ev, plugin);
-        return;
-    }
-
-    /* now, check the overlap of the 2 first keys */
-    Time decision_time = key_pressed_in_parallel(machine, simulated_time);
-
-    // well, this is an abuse ... this should never be 0.
-    if (decision_time == 0)
-    {
-        do_confirm_fork(machine, ev, plugin);
+    /* the total time, and the policy on the verificators (overlap) */
+    if (step_suspect_by_time(machine, suspect, simulated_time))
         return;
-    }
-    if (decision_time < machine->decision_time)
-        machine->decision_time = decision_time;
-
 
-    if (release_p(event) && (key == machine->suspect)){ // fixme: is release_p(event) useless?
+    fork_verificator* verificator;
+
+    if (release_p(event) && (key == suspect->suspect)){ // fixme: is release_p(event) useless?
+        Time deadline = fork_ratio_release_deadline(machine->config, suspect,
+                                                    simulated_time);
+        if (deadline) {
+            MDB(("fork-key released: the verificators' releases decide (until %u)\n",
+                 (unsigned int) deadline));
+            suspect->release_ev = ev;
+            suspect->release_time = simulated_time;
+            suspect->decision_time = deadline;
+            return;
+        }
         MDB(("fork-key released on time: %dms is a tolerated error (< %d)\n",
-             (int)(simulated_time -  machine->suspect_time),
+             (int)(simulated_time -  suspect->suspect_time),
              verification_interval_of(machine->config,
-                                      machine->suspect,
-                                      machine->verificator)));
-        machine->decision_time = 0; // useless fixme!
-        do_confirm_non_fork_by(machine, ev, plugin);
-
-    } else if (release_p(event) && (machine->verificator == key)){
-        // todo: we might be interested in percentage, Then here we should do the work!
-
-        // we should change state:
-        change_state(machine,st_suspect);
-        machine->verificator = 0;   // we _should_ take the next possible verificator
-        do_enqueue_event(machine, ev);
-    } else {               // fixme: a (repeated) press of the verificator ?
+                                      suspect->suspect,
+                                      first_verificator(suspect))));
+        learn_decided(machine, suspect, FALSE, reason_release, simulated_time);
+        deactivate_fork(machine, suspect, reason_release);
+
+    } else if (release_p(event) && (verificator = find_verificator(suspect, key))) {
+        int reason = reason_overlap;
+        policy_decision decision =
+            fork_policy_of(machine->config)->verificator_released(machine, suspect,
+                                                                  verificator,
+                                                                  simulated_time,
+                                                                  &reason);
+        if (apply_policy_decision(machine, suspect, decision, reason,
+                                  simulated_time))
+            return;
+
+        remove_verificator(suspect, key);
+        // the other verificators (if any) continue:
+        if (suspect->verificators_count == 0) {
+            if (suspect->release_ev) {
+                learn_decided(machine, suspect, FALSE, reason_ratio, simulated_time);
+                deactivate_fork(machine, suspect, reason_ratio);
+                return;
+            }
+            change_suspect_state(machine, suspect, st_suspect);
+        }
+        step_suspect_by_time(machine, suspect, simulated_time);
+    } else if (suspect->release_ev) {
+        // released: a new press is no verificator, but pressing it again ends it.
+        if (press_p(event) && (key == suspect->suspect)) {
+            learn_decided(machine, suspect, FALSE, reason_release, simulated_time);
+            deactivate_fork(machine, suspect, reason_release);
+        }
+    } else if (press_p(event) && (key != suspect->suspect)) {
         // fixme: we pressed another key: but we should tell XKB to repeat it !
-        do_enqueue_event(machine, ev);
+        if (find_verificator(suspect, key) || decide_by_pair(machine, suspect, key))
+            return;
+        verificator_pressed(machine, suspect, key, simulated_time);
     };
 }
 
 
-/* apply event EV to (state, internal-queue, time).
+/* apply event EV to (the suspects, internal-queue, time).
  * This can append to the OUTPUT-queue
  * sets: `decision_time'
  *
@@ -857,8 +1335,9 @@ apply_event_to_verify(machineRec *machine, key_event *ev, PluginInstance* plugin
  *   internal-queue  <+      input-queue
  *                   ev
  * output:
- *   either the ev  is pushed on internal_queue, or to the output-queue
- *   the head of internal_queue may be pushed to the output-queue as well.
+ *   the ev is pushed on internal_queue (or discarded). Each pending suspect
+ *   sees it, and may be decided. Then the decided head of the internal_queue
+ *   is pushed to the output-queue.
  */
 static void
 step_fork_automaton_by_key(machineRec *machine, key_event *ev, PluginInstance* plugin)
@@ -871,13 +1350,8 @@ step_fork_automaton_by_key(machineRec *machine, key_event *ev, PluginInstance* p
     InternalEvent* event = ev->event;
     KeyCode key = detail_of(event);
 
-    /* please, 1st change the state, then enqueue, and then EMIT_EVENT.
-     * fixme: should be a function then  !!!*/
-
     list_with_tail &queue = machine->internal_queue;
 
-    // machine->decision_time = 0;
-
 
 #if DDX_REPEATS_KEYS || 1
     /* `quick_ignore': I want to ignore _quickly_ the repeated forked modifiers. Normal
@@ -888,8 +1362,8 @@ step_fork_automaton_by_key(machineRec *machine, key_event *ev, PluginInstance* p
         && (key != machine->forkActive[key])) // not `self_forked'
     {
         MDB(("%s: the key is forked, ignoring\n", __FUNCTION__));
-        mxfree(ev->event, ev->event->any.length);
-        mxfree(ev, sizeof(key_event));
+        machine->counters.dropped_repeats++;
+        free_key_event(ev);
         return;
     }
 #endif
@@ -898,6 +1372,8 @@ step_fork_automaton_by_key(machineRec *machine, key_event *ev, PluginInstance* p
     // key cannot be pressed once more:
     // assert (release_p(event) || (key < MAX_KEYCODE && machine->forkActive[key] == 0));
 
+    learn_judge(plugin, machine, event);
+
 #if DEBUG
     /* describe the (state, key) */
     KeySym *sym = XkbKeySymsPtr(xkbi->desc,key);
@@ -910,23 +1386,52 @@ step_fork_automaton_by_key(machineRec *machine, key_event *ev, PluginInstance* p
          key, key_color, (char)*sym, color_reset, event_type_brief(event)));
 #endif
 
-    switch (machine->state) {
-        case st_normal:
-            apply_event_to_normal(machine, ev, plugin);
-            return;
-        case st_suspect:
-        {
-            apply_event_to_suspect(machine, ev, plugin);
-            return;
+    if ((machine->suspects_count > 0) && bypass_p(machine, event)) {
+        MDB(("%s: bypassing %d suspects\n", __FUNCTION__, machine->suspects_count));
+        if (release_p(event)) {
+            machine->last_released = key;
+            machine->last_released_time = time_of(event);
         }
-        case st_verify:
-        {
-            apply_event_to_verify(machine, ev, plugin);
-            return;
+        // decided (as not forked) too: the shadow compares it.
+        if (machine->shadow)
+            shadow_note_decided(machine, ev);
+        machine->output_queue.push(ev);
+        note_queue_length(machine->counters.max_output_queue,
+                          machine->output_queue.length());
+        try_to_output(plugin);
+        return;
+    }
+
+    /* The oldest suspect first: a discarded event is not seen by the
+     * younger ones. */
+    for (int i = 0; i < machine->suspects_count; i++) {
+        fork_suspect* suspect = machine->suspects + i;
+
+        /* The auto-repeat of an older suspect, still held: it does not exist
+         * for the younger ones. (If that one forks, it will be dropped.) */
+        if (press_p(event) && held_by_older_suspect_p(machine, suspect, key))
+            break;
+
+        switch (suspect->state) {
+            case st_suspect:
+                if (apply_event_to_suspect(machine, suspect, ev)) {
+                    machine->counters.dropped_repeats++;
+                    free_key_event(ev);
+                    release_decided_events(machine, plugin);
+                    return;
+                }
+                break;
+            case st_verify:
+                apply_event_to_verify(machine, suspect, ev);
+                break;
+            default:
+                // decided, waiting for the older ones.
+                break;
         }
-        default:
-            MDB(("----------unexpected state---------\n"));
     }
+
+    apply_event_to_normal(machine, ev, plugin);
+    release_decided_events(machine, plugin);
 }
 
 
@@ -947,38 +1452,50 @@ try_to_play(PluginInstance* plugin, Bool force)
          input_queue.length ()));
 
 
+    machine->playing = TRUE;
     while (!plugin_frozen(plugin->next)) {
 
-        if (! input_queue.empty()) {
+        /* The mouse forced, before the events (still) in the input_queue
+         * were processed. */
+        if (take_force_token(machine)) {
+            step_fork_automaton_by_force(machine, plugin, reason_force);
+        } else if (queue_limit_p(machine)) {
+            step_fork_automaton_by_force(machine, plugin, reason_queue_limit);
+        } else if ((! input_queue.empty())
+            /* no free slot for another suspect: wait for the decision */
+            && ((machine->suspects_count < MAX_SUSPECTS)
+                || bypass_p(machine, input_queue.front()->event))) {
             key_event *ev = input_queue.pop();
             // if time is enough...
             step_fork_automaton_by_key(machine, ev, plugin);
         } else {
-            // at the end ... add the final time event:
-            if (machine->current_time && (machine->state != st_normal)) {
-                // was final_state_p
+            // at the end ... add the final time event, if it can decide:
+            if (machine->current_time && (machine->suspects_count > 0)
+                && (machine->decision_time <= machine->current_time)) {
                 if (!step_fork_automaton_by_time(machine, plugin,
                                                  machine->current_time))
-                    // If this time helped to decide -> machine rewound,
+                    // If this time helped to decide -> events released,
                     // we have to try again.
                     // Otherwise, this is the end for now:
-                    return;
-            } else if (force && (machine->state != st_normal)) {
-                step_fork_automaton_by_force (machine, plugin);
+                    break;
+            } else if (force && (machine->suspects_count > 0)) {
+                step_fork_automaton_by_force (machine, plugin, reason_force);
             } else
-                return;
+                break;
         }
     }
+    machine->playing = FALSE;
     /* assert(!plugin_frozen(plugin->next)   --->
      *              queue_empty(machine->input_queue)) */
 }
 
 
 /* note: used only in configure.c!
- * Resets the machine, so as to reconsider the events on the
- * `internal' queue.
+ * Reconsider the pending suspects.
  * Apparently the criteria/configuration has changed!
- * Reasonably this is in response to a key event. So we are in Final state.
+ * The events already in the internal_queue keep their place; the suspects
+ * not forkable in the new configuration are decided (non-fork), the others
+ * are verified with the new timing.
  */
 void
 replay_events(PluginInstance* plugin, Bool force)
@@ -987,15 +1504,26 @@ replay_events(PluginInstance* plugin, Bool force)
     MDB(("%s\n", __FUNCTION__));
     CHECK_LOCKED(machine);
 
-    if (!machine->internal_queue.empty()) {
-        reverse_slice (machine->internal_queue, machine->input_queue);
+    for (int i = 0; i < machine->suspects_count; i++) {
+        fork_suspect* suspect = machine->suspects + i;
+        if (!undecided_p(suspect))
+            continue;
+        if (!forkable_p(machine->config, suspect->suspect))
+            deactivate_fork(machine, suspect, reason_config);
+        else {
+            for (int j = 0; j < suspect->verificators_count; j++)
+                suspect->verificators[j].tolerance =
+                    overlap_tolerance_of(machine->config, suspect->suspect,
+                                         suspect->verificators[j].key);
+            // the new deadline (or decision):
+            step_suspect_by_time(machine, suspect, machine->current_time);
+        }
     }
-    machine->state = st_normal;
     // todo: what else?
     // last_released & last_released_time no more available.
     machine->last_released = 0; // bug!
-    machine->decision_time = 0;     // we are not waiting for anything
 
+    release_decided_events(machine, plugin);
     try_to_play(plugin, force);
 }
 
@@ -1007,7 +1535,6 @@ replay_events(PluginInstance* plugin, Bool force)
 int                      // return, if config-mode continues.
 filter_config_key(PluginInstance* plugin,const InternalEvent *event)
 {
-    static KeyCode key_to_fork = 0;         //  what key we want to configure
     machineRec* machine;
 
     if (press_p(event))
@@ -1036,12 +1563,13 @@ filter_config_key(PluginInstance* plugin,const InternalEvent *event)
                 machine->forkActive[detail_of(event)] = 0;
                 break;
             default:            /* todo: remove this: */
-                if (key_to_fork == 0){
-                    key_to_fork = detail_of(event);
+                machine = plugin_machine(plugin);
+                if (machine->config_key_to_fork == 0){
+                    machine->config_key_to_fork = detail_of(event);
                 } else {
-                    machineRec* machine = plugin_machine(plugin);
-                    machine->config->fork_keycode[key_to_fork] = detail_of(event);
-                    key_to_fork = 0;
+                    machine->config->fork_keycode[machine->config_key_to_fork] =
+                        detail_of(event);
+                    machine->config_key_to_fork = 0;
                 }
             };
     // should we update the XKB `down' array, to signal that the key is up/down?
@@ -1053,12 +1581,13 @@ inline
 int                             // return:  0  nothing  -1  skip it
 filter_config_key_maybe(PluginInstance* plugin,const InternalEvent *event)
 {
-    static unsigned char config_mode = 0; // While the Pause key is down.
-    static Time last_press_time = 0;
+    machineRec* machine = plugin_machine(plugin);
+    unsigned char& config_mode = machine->config_mode;
+    Time& last_press_time = machine->config_press_time;
 
     if (config_mode)
     {
-        static int latch = 0;
+        int& latch = machine->config_latch;
         // [21/10/04]  I noticed, that some (non-plain ps/2) keyboard generate
         // the release event at the same time as press.
         // So, to overcome this limitation, I detect this short-lasting `down' &
@@ -1103,26 +1632,200 @@ filter_config_key_maybe(PluginInstance* plugin,const InternalEvent *event)
     return 0;
 }
 
-// NOW is useless
+/* Ask the server for a time step at TIME (at the latest), from outside the
+ * machine (the mouse dispatcher). `wakeup_time' is only lowered, with CAS: the
+ * machine might be storing its own (see set_wakeup_time). */
+static void
+machine_request_wakeup(PluginInstance* plugin, Time time)
+{
+    Time wakeup;
+
+    if (!time)                  // 0 = none
+        time = 1;
+    do {
+        wakeup = plugin->wakeup_time;
+        if (wakeup && (wakeup <= time))
+            return;
+    } while (!__sync_bool_compare_and_swap(&plugin->wakeup_time, wakeup, time));
+}
+
+
+/* Called by the client requests (main thread): the machine will carry it
+ * out, at its next step, which we ask for. Returns FALSE if there's no space. */
+Bool
+machine_post_request(PluginInstance* plugin, const int values[5])
+{
+    machineRec* machine = plugin_machine(plugin);
+
+    if (machine->requests_posted - machine->requests_taken >= MAX_REQUESTS)
+        return FALSE;
+
+    memcpy(machine->requests[machine->requests_posted & (MAX_REQUESTS - 1)].values,
+           values, sizeof(configure_request));
+    __sync_synchronize();
+    machine->requests_posted++;
+    machine_request_wakeup(plugin, GetTimeInMillis());
+    return TRUE;
+}
+
+
+/* Carry out the posted requests. */
+static void
+adopt_published(PluginInstance* plugin)
+{
+    machineRec* machine = plugin_machine(plugin);
+
+    CHECK_LOCKED(machine);
+    keymap_adopt(machine);
+    while (machine->requests_taken != machine->requests_posted) {
+        configure_request request;
+
+        __sync_synchronize();
+        request = machine->requests[machine->requests_taken & (MAX_REQUESTS - 1)];
+        __sync_synchronize();
+        machine->requests_taken++;
+        machine_configure_now(plugin, request.values);
+    }
+}
+
+
+/* The watchdog */
+
+#define WATCHDOG_INTERVAL 5000  /* ms, between 2 alarms */
+
+/* Drop the auto-repeated presses (of a key pressed before, and not released)
+ * from the input queue. Returns how many. */
+static int
+shed_repeats(machineRec* machine)
+{
+    list_with_tail kept;
+    Bool down[MAX_KEYCODE] = {FALSE};
+    int shed = 0;
+
+    while (!machine->input_queue.empty()) {
+        key_event* ev = machine->input_queue.pop();
+        InternalEvent* event = ev->event;
+
+        if (press_p(event)) {
+            if (down[detail_of(event)]) {
+                free_key_event(ev);
+                shed++;
+                continue;
+            }
+            down[detail_of(event)] = TRUE;
+        } else if (release_p(event))
+            down[detail_of(event)] = FALSE;
+        kept.push(ev);
+    }
+    machine->input_queue.swap(kept);
+    return shed;
+}
+
+
+/* Is the next plugin frozen for too long, or are the queues too deep?
+ * Record the longest freeze, raise the alarm, shed. */
+static void
+watchdog(PluginInstance* plugin)
+{
+    machineRec* machine = plugin_machine(plugin);
+    fork_configuration* config = machine->config;
+    Time now = machine->current_time;
+    int output = machine->output_queue.length();
+    int input = machine->input_queue.length();
+
+    // if not frozen, the queues are moving.
+    if (!plugin_frozen(plugin->next)) {
+        machine->frozen_since = NO_DEADLINE;
+        return;
+    }
+    if (machine->frozen_since == NO_DEADLINE)
+        machine->frozen_since = now;
+
+    Time frozen = now - machine->frozen_since;
+    if (frozen > machine->counters.max_frozen)
+        machine->counters.max_frozen = frozen;
+
+    Bool too_deep = (config->watchdog_queue && (output + input >= config->watchdog_queue));
+    if (!too_deep
+        && !(config->watchdog_frozen && (frozen >= (Time) config->watchdog_frozen)))
+        return;
+
+    if (too_deep && config->watchdog_shed)
+        machine->counters.events_shed += shed_repeats(machine);
+
+    if ((machine->watchdog_warned == NO_DEADLINE)
+        || (now - machine->watchdog_warned >= WATCHDOG_INTERVAL)) {
+        machine->watchdog_warned = now;
+        machine->counters.watchdog_alarms++;
+        ErrorF("%s: %s: the next plugin is frozen for %ums, holding %d + %d events\n",
+               FORK_PLUGIN_NAME, plugin->device->name, (unsigned int) frozen,
+               output, machine->input_queue.length());
+    }
+}
+
+
+/* In the middle of a step: a thaw now is only recorded (see fork_thaw_notify). */
+inline Bool
+machine_busy_p(machineRec* machine)
+{
+    return (machine->playing || machine->delivering || machine->thawing);
+}
+
+
+/* Is a shadow machine running next to this one? */
+inline Bool
+shadowing_p(machineRec* machine)
+{
+    return (machine->shadow && !machine->shadow_p);
+}
+
+
+/* Something posted to the machine, and not yet taken. */
+inline Bool
+machine_posted_p(machineRec* machine)
+{
+    return ((machine->force_taken != machine->force_posted)
+            || (machine->requests_taken != machine->requests_posted));
+}
+
+
+/* Ask to be woken at the earliest deadline: ours (unless the next plugin is
+ * frozen: then nothing can be decided), the next plugin's, the shadow's.
+ * NOW is useless */
 static void
 set_wakeup_time(PluginInstance* plugin, Time now)
 {
     machineRec* machine = plugin_machine(plugin);
     CHECK_LOCKED(machine);
-    if ((machine->state == st_verify)
-          || (machine->state == st_suspect))
-        // we are indeed waiting, so take the minimum.
-        plugin->wakeup_time =
-            // fixme:  but ZERO has certain meaning!
-            (plugin->next->wakeup_time == 0)?
-            machine->decision_time :
-            // MIN
-            ((machine->decision_time < plugin->next->wakeup_time)
-             ? machine->decision_time:
-             plugin->next->wakeup_time);
-    else
-        plugin->wakeup_time = plugin->next->wakeup_time;
-    // (machine->internal_queue.empty())? plugin->next->wakeup_time:0;
+
+    Time deadline = plugin_frozen(plugin->next)? NO_DEADLINE: machine->decision_time;
+
+    // the server's 0 = none:
+    if (plugin->next->wakeup_time && (plugin->next->wakeup_time < deadline))
+        deadline = plugin->next->wakeup_time;
+    // the shadow machine has its timers too:
+    if (shadowing_p(machine) && machine->shadow->plugin.wakeup_time
+        && (machine->shadow->plugin.wakeup_time < deadline))
+        deadline = machine->shadow->plugin.wakeup_time;
+
+    // the watchdog wants to see a long freeze:
+    if (plugin_frozen(plugin->next) && machine->config->watchdog_frozen
+        && (machine->frozen_since != NO_DEADLINE)) {
+        Time alarm = machine->frozen_since + machine->config->watchdog_frozen;
+        if ((alarm <= machine->current_time) && (machine->watchdog_warned != NO_DEADLINE))
+            alarm = machine->watchdog_warned + WATCHDOG_INTERVAL;
+        if (alarm < deadline)
+            deadline = alarm;
+    }
+
+    // fixme: a deadline at time 0 cannot be asked for.
+    plugin->wakeup_time = (deadline == NO_DEADLINE)? 0: deadline;
+
+    /* Posted after try_to_play looked: the poster's request might have been
+     * overwritten just now. */
+    __sync_synchronize();
+    if (machine_posted_p(machine))
+        machine_request_wakeup(plugin, GetTimeInMillis());
 
     MDB(("%s %s wakeup_time = %u, next wants: %u, we %u\n", FORK_PLUGIN_NAME, __FUNCTION__,
          (int)plugin->wakeup_time, (int)plugin->next->wakeup_time,machine->decision_time));
@@ -1161,53 +1864,144 @@ create_handle_for_event(InternalEvent *event, bool owner)
 #endif
     ev->event = qe;
     ev->forked = 0;
+    ev->outcome = fork_outcome_plain;
+    ev->reason = reason_none;
+    ev->entered = GetTimeInMillis();
     return ev;
 }
 
 
 
+/* Called from AllowEvents, after all events from following plugins have been pushed: .
+ *
+ * The next plugin often thaws while we hand it our events, or push the time
+ * (it calls us back).  Then we only record the thaw, and the outer call
+ * handles it, in a loop: the stack does not grow, and we scan the queues once
+ * for any number of thaws. */
+static void
+fork_thaw_notify(PluginInstance* plugin, Time now)
+{
+    machineRec* machine = plugin_machine(plugin);
+    MDB(("%s @ time %u\n", __FUNCTION__, (int)now));
+
+    PROBE_THAW(machine, now, machine_busy_p(machine));
+    trace_note(machine, trace_thaw, 0, machine_busy_p(machine), 0, 0);
+    machine->thaw_time = now;
+    if (machine_busy_p(machine)) {
+        machine->thaw_pending = TRUE;
+        machine->counters.thaws_deferred++;
+        return;
+    }
+
+    Bool notify_prev;
+    machine->thawing = TRUE;
+    do {
+        machine->thaw_pending = FALSE;
+        machine->counters.thaws++;
+
+        LOCK(machine);
+        adopt_published(plugin);
+        try_to_output(plugin);
+        // is this correct?
+
+        try_to_play(plugin, FALSE);
+        watchdog(plugin);
+        set_wakeup_time(plugin, machine->current_time);
+        notify_prev = (!plugin_frozen(plugin->next)
+                       && PluginClass(plugin->prev)->NotifyThaw);
+        UNLOCK(machine);
+    } while (machine->thaw_pending);
+    machine->thawing = FALSE;
+
+    if (notify_prev)
+    {
+        /* thaw the previous! */
+        MDB(("%s -- sending thaw Notify upwards!\n", __FUNCTION__));
+        /* Once, for all the thaws handled. */
+        PluginClass(plugin->prev)->NotifyThaw(plugin->prev, machine->thaw_time);
+        /* I could move now to the time of our event. */
+        /* step_in_time_locked(plugin); */
+    } else {
+        MDB(("%s -- NOT sending thaw Notify upwards %s!\n", __FUNCTION__,
+             plugin_frozen(plugin->next)?"next is frozen":"prev has not NotifyThaw"));
+    }
+}
+
+
+/* A thaw recorded while we were busy, and nobody handled it. */
+inline void
+handle_pending_thaw(PluginInstance* plugin)
+{
+    machineRec* machine = plugin_machine(plugin);
+    if (machine->thaw_pending && !machine_busy_p(machine))
+        fork_thaw_notify(plugin, machine->thaw_time);
+}
+
+
 /*  This is the handler for all key events.  Here we delay pushing them forward.
     it's a trampoline for the automaton.
     Should it return some Time?
 */
 static void
-ProcessEvent(PluginInstance* plugin, InternalEvent *event, Bool owner)
+accept_event(PluginInstance* plugin, InternalEvent *event, Bool owner)
 {
     DeviceIntPtr keybd = plugin->device;
-
-    if (filter_config_key_maybe(plugin, event) < 0)
-    {
-        // fixme: I should at least push the time of (plugin->next)!
-        if (owner)
-            free(event);
-        return;
-    };
     machineRec* machine = plugin_machine(plugin);
 
     CHECK_UNLOCKED(machine);
     LOCK(machine);           // fixme: mouse must not interrupt us.
+    adopt_published(plugin);
 
     machine->current_time = time_of(event);
+    machine->counters.events_in++;
+    PROBE_EVENT_IN(machine, detail_of(event), event->any.type, time_of(event));
+    trace_note(machine, trace_event_in, detail_of(event), event->any.type, 0,
+               time_of(event));
     key_event* ev = create_handle_for_event(event, owner);
-    if (!ev)			// memory problems
+    if (!ev) {			// memory problems
         // what to do with `event' !!
+        machine->counters.alloc_failures++;
+        UNLOCK(machine);
         return;
+    }
 
 #if DEBUG
     if (((machineRec*) plugin_machine(plugin))->config->debug) {
         DB(("%s>>> ", key_io_color));
-        DB(("%s", describe_key(keybd, ev->event)));
+        DB(("%s", describe_key(machine, keybd, ev->event)));
         DB(("%s\n", color_reset));
     }
 #endif
 
     machine->input_queue.push(ev);
+    note_queue_length(machine->counters.max_input_queue, machine->input_queue.length());
     try_to_play(plugin, FALSE);
+    watchdog(plugin);
 
     set_wakeup_time(plugin, machine->current_time);
     UNLOCK(machine);
+    handle_pending_thaw(plugin);
 };
 
+
+static void
+ProcessEvent(PluginInstance* plugin, InternalEvent *event, Bool owner)
+{
+    if (filter_config_key_maybe(plugin, event) < 0)
+    {
+        // fixme: I should at least push the time of (plugin->next)!
+        if (owner)
+            free(event);
+        return;
+    };
+    machineRec* machine = plugin_machine(plugin);
+
+    // The shadow gets a copy: we might change (and hand over) the EVENT.
+    if (shadowing_p(machine))
+        accept_event(&machine->shadow->plugin, event, FALSE);
+    accept_event(plugin, event, owner);
+}
+
 // this is an internal call.
 static void
 step_in_time_locked(PluginInstance* plugin)
@@ -1227,12 +2021,11 @@ step_in_time_locked(PluginInstance* plugin)
     if (machine->internal_queue.empty() && machine->input_queue.empty()
         && !plugin_frozen(plugin->next))
     {
-        UNLOCK(machine);
-        /* might this be invoked several times?  */
-        PluginClass(plugin->next)->ProcessTime(plugin->next, machine->current_time);
-        LOCK(machine);
+        /* might this be invoked several times?  Yes: suppressed then. */
+        push_time_to_next(plugin, machine->current_time);
     }
     // todo: we could push the time before the first event in internal queue!
+    watchdog(plugin);
     set_wakeup_time(plugin, machine->current_time);
 }
 
@@ -1242,64 +2035,229 @@ step_in_time(PluginInstance* plugin, Time now)
 {
     machineRec* machine = plugin_machine(plugin);
     MDB(("%s:\n", __FUNCTION__));
+    if (shadowing_p(machine))
+        step_in_time(&machine->shadow->plugin, now);
     LOCK(machine);
+    adopt_published(plugin);
+    if (machine->latency)
+        latency_note_wakeup(machine->latency, plugin->wakeup_time, now,
+                            GetTimeInMillis());
+    if (machine->suspects_count > 0)
+        machine->counters.wakeups++;
+    if (machine->decision_time == NO_DEADLINE)
+        machine->counters.idle_steps++;
     machine->current_time = now;
     step_in_time_locked(plugin);
     UNLOCK(machine);
+    handle_pending_thaw(plugin);
 };
 
 
-/* Called from AllowEvents, after all events from following plugins have been pushed: . */
+/* Should this pointer EVENT force the fork? */
+static Bool
+mouse_forces_p(machineRec* machine, const InternalEvent* event)
+{
+    fork_configuration* config = machine->config;
+
+    switch (event->any.type) {
+        case ET_ButtonPress:
+            return config->force_on_button;
+        case ET_Motion:
+            if (!config->force_on_motion)
+                return FALSE;
+            if (!config->motion_threshold)
+                return TRUE;
+            if (!machine->motion_anchored
+                || (machine->anchor_generation != machine->pending_generation)) {
+                machine->motion_anchored = TRUE;
+                machine->anchor_generation = machine->pending_generation;
+                machine->anchor_x = event->device_event.root_x;
+                machine->anchor_y = event->device_event.root_y;
+                return FALSE;
+            }
+            return (abs(event->device_event.root_x - machine->anchor_x)
+                    + abs(event->device_event.root_y - machine->anchor_y)
+                    > config->motion_threshold);
+        default:
+            return FALSE;
+    }
+}
+
+
+/* Can the EVENT of DEVICE force a fork?  Only the pointer events (see
+ * mouse_forces_p) of devices with buttons or axes: not the other keyboards. */
+inline Bool
+pointer_event_p(DeviceIntPtr device, const InternalEvent* event)
+{
+    return (((event->any.type == ET_Motion) || (event->any.type == ET_ButtonPress))
+            && (device->button || device->valuator));
+}
+
+
+/* This is called for every event of every device: so return as soon as
+ * possible, if there's nothing to force. */
 static void
-fork_thaw_notify(PluginInstance* plugin, Time now)
+mouse_dispatcher(CallbackListPtr *, void* unused, DeviceEventInfoRec* dei)
 {
-    machineRec* machine = plugin_machine(plugin);
-    MDB(("%s @ time %u\n", __FUNCTION__, (int)now));
+    InternalEvent *event = dei->event;
 
-    LOCK(machine);
-    try_to_output(plugin);
-    // is this correct?
+    if ((machines_pending == 0) || !pointer_event_p(dei->device, event))
+        return;
 
-    try_to_play(plugin, FALSE);
+    __sync_fetch_and_add(&dispatchers_running, 1);
+    for (int i = 0; i < MAX_MACHINES; i++) {
+        machineRec* machine = machines_registry[i];
+        if (!machine)
+            continue;
+        PluginInstance* plugin = machine->plugin;
+
+        // our own keys are not from a mouse:
+        if ((dei->device == plugin->device) || !machine->suspect_pending)
+            continue;
+        ATOMIC_INC(machine->counters.mouse_calls);
+        if (!mouse_forces_p(machine, event))
+            continue;
+
+        ATOMIC_INC(machine->counters.mouse_forces);
+        machine->motion_anchored = FALSE;
+        if (machine->lock)
+            ATOMIC_INC(machine->counters.lock_collisions);
+
+        /* We never run the automaton here: try_to_play takes the token, at
+         * the time step we ask for (or at the thaw, if the next plugin is
+         * frozen), before the queued input events. */
+        post_force_token(machine);
+        Time now = GetTimeInMillis();
+        machine_request_wakeup(plugin, now);
+        // the server wakes only the live machine, which steps the shadow:
+        if (machine->shadow_p)
+            machine_request_wakeup(machine->shadow->live->plugin, now);
+    }
+    __sync_fetch_and_sub(&dispatchers_running, 1);
+}
 
-    if (!plugin_frozen(plugin->next) && PluginClass(plugin->prev)->NotifyThaw)
-    {
-        /* thaw the previous! */
-        set_wakeup_time(plugin, machine->current_time);
-        UNLOCK(machine);
-        MDB(("%s -- sending thaw Notify upwards!\n", __FUNCTION__));
-        /* fixme:  Tail-recursion! */
-        PluginClass(plugin->prev)->NotifyThaw(plugin->prev, now);
-        /* I could move now to the time of our event. */
-        /* step_in_time_locked(plugin); */
-    } else {
-        MDB(("%s -- NOT sending thaw Notify upwards %s!\n", __FUNCTION__,
-             plugin_frozen(plugin->next)?"next is frozen":"prev has not NotifyThaw"));
-        UNLOCK(machine);
+
+/* The automaton itself, running with CONFIG, keeping MAX_LAST events of history. */
+static machineRec*
+new_machine(fork_configuration* config, int max_last)
+{
+    machineRec* forking_machine =  (machineRec* )mmalloc(sizeof(machineRec));
+
+    if (! forking_machine){
+        ErrorF("%s: malloc failed (for forking_machine)\n",__FUNCTION__);
+        return NULL;
     }
+    bzero(forking_machine, sizeof (machineRec));
+
+    // now, if something goes wrong, we have to free it!!
+    forking_machine->internal_queue.set_name("internal");
+    forking_machine->input_queue.set_name("input");
+    forking_machine->output_queue.set_name("output");
+
+
+    forking_machine->max_last = max_last;
+    forking_machine->last_events = new last_events_type(forking_machine->max_last);
+
+    forking_machine->state = st_normal;
+    forking_machine->last_released = 0;
+    forking_machine->decision_time = NO_DEADLINE;
+    forking_machine->current_time = 0;
+    forking_machine->learn = NULL;
+    forking_machine->latency = NULL;
+    forking_machine->trace = NULL;
+    forking_machine->keymap = NULL;
+    forking_machine->keymap_watch.published = NULL;
+    forking_machine->keymap_watch.made = FALSE;
+    forking_machine->shadow = NULL;
+    forking_machine->shadow_p = FALSE;
+    forking_machine->suspect_pending = FALSE;
+    forking_machine->plugin = NULL;
+    forking_machine->force_posted = forking_machine->force_taken = 0;
+    forking_machine->playing = FALSE;
+    forking_machine->requests_posted = forking_machine->requests_taken = 0;
+    forking_machine->config_mode = 0;
+    forking_machine->config_press_time = 0;
+    forking_machine->config_latch = 0;
+    forking_machine->config_key_to_fork = 0;
+    forking_machine->delivering = FALSE;
+    forking_machine->time_sent = 0;
+    forking_machine->thawing = forking_machine->thaw_pending = FALSE;
+    forking_machine->thaw_time = 0;
+    forking_machine->frozen_since = forking_machine->watchdog_warned = NO_DEADLINE;
+    forking_machine->motion_anchored = FALSE;
+    forking_machine->anchor_generation = forking_machine->pending_generation = 0;
+    bzero(&forking_machine->counters, sizeof(fork_counters));
+
+    UNLOCK(forking_machine);
+
+
+    for (int i=0;i<256;i++){                   // keycode 0 is unused!
+        forking_machine->forkActive[i] = 0; /* 0 = not active */
+    };
+
+    forking_machine->config = config;
+    return forking_machine;
 }
 
 
-/* For now this is called to many times, for different events.! */
 static void
-mouse_call_back(CallbackListPtr *, PluginInstance* plugin,
-                DeviceEventInfoRec* dei)
+free_queue(list_with_tail& queue)
+{
+    while (!queue.empty())
+        free_key_event(queue.pop());
+}
+
+
+/* Start running CONFIG in the shadow (replacing the previous one).
+ * Returns 0 on success. */
+int
+machine_start_shadow(PluginInstance* plugin, fork_configuration* config)
 {
-    InternalEvent *event = dei->event;
     machineRec* machine = plugin_machine(plugin);
 
-    if (event->any.type == ET_Motion)
-    {
-        if (machine->lock)
-            ErrorF("%s running, while the machine is locked!\n", __FUNCTION__);
-        /* else */
-        LOCK(machine);
-        /* bug: if we were frozen, then we have a sequence of keys, which
-         * might be already released, so the head is not to be forked!
-         */
-        step_fork_automaton_by_force(plugin_machine(plugin), plugin);
-        UNLOCK(machine);
+    machine_stop_shadow(plugin);
+
+    struct shadow_state* shadow = MALLOC(struct shadow_state);
+    if (!shadow) {
+        ErrorF("%s: malloc failed\n", __FUNCTION__);
+        return -1;
     }
+    machineRec* shadow_machine = new_machine(config, 1);
+    if (!shadow_machine) {
+        free(shadow);
+        return -1;
+    }
+
+    shadow_init(shadow, plugin, shadow_machine);
+    shadow_machine->current_time = machine->current_time;
+    machine->shadow = shadow;
+    register_machine(shadow_machine);
+    MDB(("%s: shadowing config %d\n", __FUNCTION__, config->id));
+    return 0;
+}
+
+
+void
+machine_stop_shadow(PluginInstance* plugin)
+{
+    machineRec* machine = plugin_machine(plugin);
+
+    if (!shadowing_p(machine))
+        return;
+
+    struct shadow_state* shadow = machine->shadow;
+    machineRec* shadow_machine = shadow->machine;
+
+    machine->shadow = NULL;
+    set_suspect_pending(shadow_machine, FALSE);
+    unregister_machine(shadow_machine);
+    free_queue(shadow_machine->input_queue);
+    free_queue(shadow_machine->internal_queue);
+    free_queue(shadow_machine->output_queue);
+    delete shadow_machine->last_events;
+    mxfree(shadow_machine, sizeof(machineRec));
+    free(shadow);
+    MDB(("%s: shadow stopped\n", __FUNCTION__));
 }
 
 
@@ -1342,46 +2300,26 @@ make_machine(DeviceIntPtr keybd, DevicePluginRec* plugin_class)
     ErrorF("%s: constructing the machine %d (official release: %s)\n",
            __FUNCTION__, PLUGIN_VERSION, VERSION_STRING);
 
-    forking_machine =  (machineRec* )mmalloc(sizeof(machineRec));
-    bzero(forking_machine, sizeof (machineRec));
-
+    forking_machine = new_machine(config, 100);
     if (! forking_machine){
-        ErrorF("%s: malloc failed (for forking_machine)\n",__FUNCTION__);
         // free all the previous ....!
         return NULL;              // BadAlloc
     }
-
-
-    // now, if something goes wrong, we have to free it!!
-    forking_machine->internal_queue.set_name("internal");
-    forking_machine->input_queue.set_name("input");
-    forking_machine->output_queue.set_name("output");
-
-
-    forking_machine->max_last = 100;
-    forking_machine->last_events = new last_events_type(forking_machine->max_last);
-
-    forking_machine->state = st_normal;
-    forking_machine->last_released = 0;
-    forking_machine->decision_time = 0;
-    forking_machine->current_time = 0;
     // set_wakeup_time(plugin, 0);
     plugin->wakeup_time = 0;
 
-    UNLOCK(forking_machine);
-
-
-    for (int i=0;i<256;i++){                   // keycode 0 is unused!
-        forking_machine->forkActive[i] = 0; /* 0 = not active */
-    };
-
     config->debug = 1;
-    forking_machine->config = config;
 
     plugin->data = (void*) forking_machine;
     ErrorF("%s: returning %d\n", __FUNCTION__, Success);
 
-    AddCallback(&DeviceEventCallback, (CallbackProcPtr) mouse_call_back, (void*) plugin);
+    forking_machine->plugin = plugin;
+    forking_machine->latency = latency_new();
+    trace_start_formatting(plugin);
+    keymap_start_watching(plugin);
+    register_machine(forking_machine);
+    if (dispatcher_users++ == 0)
+        AddCallback(&DeviceEventCallback, (CallbackProcPtr) mouse_dispatcher, NULL);
 
     plugin_class->ref_count++;
 
@@ -1411,9 +2349,18 @@ destroy_machine(PluginInstance* plugin)
     machineRec* machine = plugin_machine(plugin);
     LOCK(machine);
 
+    unregister_machine(machine);
     delete machine->last_events;
-    DeleteCallback(&DeviceEventCallback, (CallbackProcPtr) mouse_call_back,
-                   (void*) plugin);
+    learn_free(machine);
+    latency_free(machine);
+    trace_stop_formatting(plugin);
+    trace_free(machine);
+    keymap_stop_watching(plugin);
+    keymap_free(machine);
+    machine_stop_shadow(plugin);
+    set_suspect_pending(machine, FALSE);
+    if (--dispatcher_users == 0)
+        DeleteCallback(&DeviceEventCallback, (CallbackProcPtr) mouse_dispatcher, NULL);
     MDB(("%s: what to do?\n", __FUNCTION__));
     return 1;
 }
@@ -13,6 +13,7 @@ extern "C" {
 #include <X11/Xproto.h>
 #include <X11/keysym.h>
 #include <xorg/inputstr.h>
+#include <xorg/xkbstr.h>
 
 
 #include <X11/Xdefs.h>
@@ -43,8 +44,28 @@ using namespace __gnu_cxx;
 typedef my_queue<key_event> list_with_tail;
 
 
-#define plugin_machine(p) ((machineRec*)(plugin->data))
+#define plugin_machine(p) ((machineRec*)((p)->data))
 #define MALLOC(type)   (type *) malloc(sizeof (type))
+
+/* The machine runs on the input thread, the client requests (configuration,
+ * counters) on the main thread, and the machine carries them out.  So the
+ * counters are written only by the machine (with ++), except for those of the
+ * mouse dispatcher: */
+#define ATOMIC_INC(counter)   __sync_fetch_and_add(&(counter), 1)
+
+/* A deadline which never comes. (The server's `wakeup_time' uses 0 for it,
+ * but 0 is a valid Time.) */
+#define NO_DEADLINE ((Time) -1)
+
+/* The client requests waiting for the machine (see `requests'). */
+#define MAX_REQUESTS 64         /* a power of 2 */
+
+typedef struct
+{
+    int values[5];              /* as given to machine_configure */
+} configure_request;
+
+#define BufferLength 200        /* of the descriptions (for debugging) */
 #define MAX_KEYCODE 256   	/* fixme: inherit from xorg! */
 typedef int keycode_parameter_matrix[MAX_KEYCODE][MAX_KEYCODE];
 
@@ -61,6 +82,13 @@ struct _fork_configuration
   KeyCode          fork_keycode[MAX_KEYCODE];
   Bool          fork_repeatable[MAX_KEYCODE]; /* True -> if repeat, cancel possible fork. */
 
+  /* The bypass lane: these keys (and, if bypass_non_key, the non-key
+     events) never wait behind a suspect: they are not considered for the
+     fork, and go directly to the output queue. I.e. they overtake the
+     events held by an undecided suspect, but never the already decided ones. */
+  Bool          bypass_keycode[MAX_KEYCODE];
+  Bool          bypass_non_key;
+
   /* we don't consider an overlap, until this ms.
      fixme: we need better. a ration between `before'/`overlap'/`after' */
   keycode_parameter_matrix overlap_tolerance;
@@ -69,8 +97,64 @@ struct _fork_configuration
      Should be around the key-repeatition rate (1st pause) */
   keycode_parameter_matrix verification_interval;
 
+  /* fork_pair_{wait,fork,no_fork}: some pairs (suspect, verificator) decide
+     as soon as the verificator is pressed. The 0 row is for any suspect. */
+  unsigned char pair_decision[MAX_KEYCODE][MAX_KEYCODE];
+
+  /* The modifiers, which (we declare) only select the keysyms (level), e.g.
+     ShiftMask. If the fork target has only these, and they don't change the
+     keysyms of the verificator, there is no point to fork. 0 = not used
+     (the default: the clients do see the modifiers), FORK_KEYMAP_MODS_AUTO =
+     the level3/level5 shifts of the keymap. */
+  unsigned int keymap_mods;
+
+  /* The overlap can be judged relatively too, in percents (0 = not used):
+     fork_ratio_before:   overlap / time between the suspect & verificator presses
+     fork_ratio_duration: overlap / duration of the verificator press. If the
+                          suspect is released first, the verificator's
+                          release decides.
+     fork_ratio_before asks for at least 20ms (RATIO_MIN_OVERLAP).
+     Whichever decides first (with the absolute overlap_tolerance) wins. */
+  int overlap_ratio;
+  int overlap_ratio_rule;
+
+  int policy;                   /* fork_policy_*: how the verificators decide */
+
   int clear_interval;
   int repeat_max;
+  /* ms. A forkable key pressed so soon after a non-forked press is not
+     suspected: we are typing fast. 0 = not used. */
+  int streak_interval;
+
+  /* The worst case: no event is held longer than max_hold ms, and no more
+     than max_queue events wait (internal + input queue). Then the oldest
+     suspect is decided by force: forked if `force_fork', otherwise not.
+     0 = no limit. */
+  int max_hold;
+  int max_queue;
+  Bool force_fork;
+
+  /* Which pointer events force the fork (of the oldest suspect). The motion
+     only if it moved (since the first motion seen) more than motion_threshold
+     pixels. */
+  Bool force_on_motion;
+  Bool force_on_button;
+  int motion_threshold;
+
+  /* The watchdog: the next plugin frozen for watchdog_frozen ms, or
+     watchdog_queue events held (input + output queue) raise an alarm (a log
+     line, at most every WATCHDOG_INTERVAL). With watchdog_shed, the
+     auto-repeated presses in the input queue are dropped then. 0 = off. */
+  int watchdog_frozen;
+  int watchdog_queue;
+  Bool watchdog_shed;
+
+  /* Learning mode (see learn.h): the limits of a pair are moved by this many
+     ms, after each judged decision. 0 = not used. */
+  int learn_step;
+  int learn_min;                /* the bounds of the learnt limits */
+  int learn_max;
+  KeyCode learn_undo_key;       /* pressed soon after a decision: it was wrong */
   Bool consider_forks_for_repeat;
   int debug;
 
@@ -81,6 +165,10 @@ struct _fork_configuration
 
 
 
+/* How we decided for the fork: reason_* in fork_requests.h (the clients see
+ * it in the archived events). */
+
+
 /* states of the automaton: */
 typedef enum {
   st_normal,
@@ -91,13 +179,85 @@ typedef enum {
 } state_type;
 
 
+/* What the keymap says about the pairs (fork target, verificator): */
+typedef struct
+{
+    unsigned int mods;          /* the modifiers taken as level-only */
+
+    /* bit set -> the modifiers of the target don't change the keysyms of the
+     * verificator */
+    unsigned char no_fork[MAX_KEYCODE][MAX_KEYCODE / 8];
+} keymap_analysis;
+
+
+/* The main thread's side of it (see keymap.cpp): */
+typedef struct
+{
+    keymap_analysis* volatile published; /* not yet taken by the machine */
+    Bool made;                  /* the following are valid: */
+    unsigned int serial;        /* the fingerprint of the keymap analysed */
+    unsigned int mods;          /* the `keymap_mods' it was made for */
+    Time checked;               /* when the keymap was last fingerprinted */
+} keymap_watch_state;
+
+
+/* How many forkable keys can wait for a decision at the same time. When all
+ * the slots are taken, we stop reading the input_queue: i.e. we fall back to
+ * deciding the suspects one after another. */
+#define MAX_SUSPECTS 8
+
+/* How many keys (pressed after the suspect, and still down) we consider
+ * for the overlap. */
+#define MAX_VERIFICATORS 8
+
+/* A key pressed after the suspect: if it overlaps long enough, the suspect forks. */
+typedef struct
+{
+    KeyCode key;
+    Time time;                  /* press */
+    Time tolerance;             /* the overlap_tolerance for the pair (suspect, key) */
+} fork_verificator;
+
+/* One (still) pending forkable press, with its own automaton registers. */
+typedef struct
+{
+    unsigned char state;        /* st_suspect/st_verify, or final:
+                                 * st_activated (forked) st_deactivated */
+    KeyCode suspect;
+    Time suspect_time;          /* press of the `suspect' */
+    Time state_since;           /* server time, entering the `state' */
+
+    /* in order of their presses. The 1st one selects the verification_interval */
+    fork_verificator verificators[MAX_VERIFICATORS];
+    int verificators_count;
+
+    // calculated:
+    Time decision_time;         /* when the time alone can decide */
+
+    unsigned char reason;       /* if forked: how we decided */
+
+    key_event* ev;              /* the press, kept in the internal_queue */
+    int held_repeats;           /* (auto-repeated) presses of `suspect' queued after it.
+                                 * To be ignored if we fork. */
+    /* Released (in the internal_queue), waiting for the verificators' releases
+     * (see fork_ratio_release_deadline). NULL otherwise. */
+    key_event* release_ev;
+    Time release_time;
+} fork_suspect;
+
+
 /* `machine': the dynamic `state' */
 
+struct learn_state;
+struct shadow_state;
+struct latency_state;
+struct trace_ring;
+
 typedef struct machine
 {
     volatile int lock;           /* the mouse interrupt handler should ..... err!  `volatile'
                                   * useless mmc!  But i want to avoid any caching it.... SMP ??*/
-    unsigned char state;
+    unsigned char state;         /* st_normal, or the state of the oldest suspect */
 
     /* To allow AR for forkable keys:
      * When we press a key the second time in a row, we might avoid forking:
@@ -107,25 +267,98 @@ typedef struct machine
     KeyCode last_released; // .- trick
     int last_released_time;
 
-    KeyCode suspect;
-    KeyCode verificator;
+    Time last_plain_press_time; // typing streak: the last press not forked.
+
+    /* The pending suspects, in the order of their presses. Each one is decided
+     * by the events following it, so they are decided in parallel, but
+     * released (output) in order. */
+    fork_suspect suspects[MAX_SUSPECTS];
+    int suspects_count;
 
-    // these are "registers"
-    Time suspect_time;           /* time of the 1st event in the queue. */
-    Time verificator_time;       /* press of the `verificator' */
     // calculated:
-    Time decision_time;		/* Time to wait... so that the current event queue could decide more*/
+    Time decision_time;		/* The earliest deadline of the suspects (when the
+                                 * time alone decides), or NO_DEADLINE */
     Time current_time;
 
+    /* how many (auto-repeated) presses of a forked key still in the
+     * internal_queue, we have to ignore. */
+    unsigned char drop_repeats[MAX_KEYCODE];
+
     /* we cannot hold only a Bool, since when we have to reconfigure, we need the original
        forked keycode for the release event. */
     KeyCode          forkActive[MAX_KEYCODE];
 
+    /* see `keymap_mods'. NULL until the first one is published. The shadow
+     * machine has none: it uses the live machine's. */
+    keymap_analysis* keymap;
+    keymap_watch_state keymap_watch;
+
+    PluginInstance* plugin;     /* our instance (for the mouse dispatcher) */
+
+    /* For the mouse callback (on every device event of every device!), to
+     * return quickly: */
+    volatile Bool suspect_pending; /* suspects_count > 0: the mouse may force */
+    volatile unsigned int pending_generation; /* ++ when it becomes pending */
+    /* Written only by the dispatcher: the first motion while pending (i.e.
+     * in the `pending_generation'): */
+    Bool motion_anchored;
+    unsigned int anchor_generation;
+    int anchor_x, anchor_y;
+    /* The mouse dispatcher does not run the automaton: it posts `force'
+     * tokens, to be taken by try_to_play, and asks for a time step
+     * (machine_request_wakeup). Single producer (the dispatcher), single
+     * consumer (the machine): each side writes only its counter. */
+    volatile unsigned int force_posted;
+    volatile unsigned int force_taken;
+    Bool playing;               /* inside try_to_play: it will take the tokens */
+
+    /* All the changes requested by clients (on the main thread) are posted
+     * here, and carried out by the machine (on the input thread), at its next
+     * step (see adopt_published). Single producer, single consumer. */
+    configure_request requests[MAX_REQUESTS];
+    volatile unsigned int requests_posted;
+    volatile unsigned int requests_taken;
+
+    /* the hot-keys (see filter_config_key): */
+    unsigned char config_mode;  /* While the Pause key is down. */
+    Time config_press_time;
+    int config_latch;
+    KeyCode config_key_to_fork; /* what key we want to configure */
+
+    /* Output (see try_to_output): */
+    Bool delivering;            /* handing over a run of events */
+    Time time_sent;             /* the last ProcessTime pushed to the next plugin */
+
+    /* the thaw trampoline (see fork_thaw_notify): */
+    Bool thawing;
+    volatile Bool thaw_pending; /* the next plugin thawed, while we were busy */
+    Time thaw_time;
+
+    /* the watchdog: */
+    Time frozen_since;          /* the next plugin, NO_DEADLINE if not frozen */
+    Time watchdog_warned;       /* the last alarm */
+
+    /* for debugging, see describe_key() */
+    char key_buffer[BufferLength];
+    char state_buffer[BufferLength];
+
+    /* for the monitoring (fork_client_machine): all the counters. The mouse
+     * dispatcher's (mouse_*, lock_collisions) with ATOMIC_INC. */
+    fork_counters counters;
+
+    struct learn_state* learn;  /* allocated when learning (`learn_step') */
+    struct latency_state* latency; /* the hold-latency histograms (not in the shadow) */
+    struct trace_ring* trace;   /* allocated when tracing (fork_configure_trace) */
+
+    /* Shadow mode (see shadow.h): set in both the live & the shadow machine. */
+    struct shadow_state* shadow;
+    Bool shadow_p;              /* this is the shadow machine */
+
 
 
     list_with_tail internal_queue;
-    /* Still undecided events: these events alone don't decide what event is the 1st on the
-       queue.*/
+    /* Events waiting for the decision on a suspect (pressed before them). The
+       suspects themselves are here too.*/
     list_with_tail input_queue;  /* Not yet processed at all. Since we wait for external
                                   * events to resume processing (Grab is active-frozen) */
     list_with_tail output_queue; /* We have decided, but externals don't accept, so we keep them. */
@@ -138,10 +371,54 @@ typedef struct machine
 
 
 
+/* The Static state = configuration.
+ * This is the matrix with some Time values:
+ * using the fact, that valid KeyCodes are non zero, we use
+ * the 0 column for `code's global values
+
+ * Global      xxxxxxxx unused xxxxxx
+ * key-wise   per-pair per-pair ....
+ * key-wise   per-pair per-pair ....
+ * ....
+ */
+
+inline Time
+get_value_from_matrix (keycode_parameter_matrix matrix, KeyCode code, KeyCode verificator)
+{
+    return (matrix[code][verificator]?
+            matrix[code][verificator]:
+            (matrix[code][0]?
+             matrix[code][0]: matrix[0][0]));
+}
+
+
+// note: depending on verificator is strange. There might be none!
+inline Time
+verification_interval_of(fork_configuration* config,
+                         KeyCode code, KeyCode verificator)
+{
+    return get_value_from_matrix (config->verification_interval, code,
+                                  verificator);
+}
+
+
+inline Time
+overlap_tolerance_of(fork_configuration* config, KeyCode code,
+                     KeyCode verificator)
+{
+    return get_value_from_matrix (config->overlap_tolerance, code, verificator);
+}
+
+
+
 extern fork_configuration* machine_new_config(void);
 extern void machine_switch_config(PluginInstance* plugin, machineRec* machine,int id);
 extern int machine_set_last_events_count(machineRec* machine, int new_max);
 extern void replay_events(PluginInstance* plugin, Bool force);
+extern Bool machine_post_request(PluginInstance* plugin, const int values[5]);
+extern void machine_set_shadow(PluginInstance* plugin, machineRec* machine, int id);
+extern int machine_start_shadow(PluginInstance* plugin, fork_configuration* config);
+extern void machine_stop_shadow(PluginInstance* plugin);
 
 extern int dump_last_events_to_client(PluginInstance* plugin, ClientPtr client, int n);
 
@@ -161,9 +438,9 @@ void* mmalloc(size_t size)
   void* p = malloc(size);
   if (p)
     {
-      memory_balance += size;
-      if (memory_balance > sizeof(machineRec) + sizeof(PluginInstance) + 2000)
-        ErrorF("%s: memory_balance = %ld\n", __FUNCTION__, memory_balance);
+      size_t balance = __sync_add_and_fetch(&memory_balance, size);
+      if (balance > sizeof(machineRec) + sizeof(PluginInstance) + 2000)
+        ErrorF("%s: memory_balance = %ld\n", __FUNCTION__, balance);
     }
   return p;
 }
@@ -172,7 +449,7 @@ inline
 void
 mxfree(void* p, size_t size)
 {
-  memory_balance -= size;
+  __sync_fetch_and_sub(&memory_balance, size);
   free(p);
 }
 
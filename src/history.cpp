@@ -8,6 +8,7 @@
 #include "history.h"
 #include "fork.h"
 #include "fork_requests.h"
+#include "latency.h"
 
 
 extern "C" {
@@ -30,14 +31,18 @@ extern "C" {
 
 
 archived_event*
-make_archived_events (key_event* ev)
+make_archived_events (key_event* ev, Time now)
 {
   archived_event* event = MALLOC(archived_event);
+  if (!event)
+    return NULL;
 
   event->key = detail_of(ev->event);
   event->time = time_of(ev->event);
   event->press = press_p(ev->event);
   event->forked = ev->forked;
+  event->reason = ev->reason;
+  event->hold = histogram_bucket(now - ev->entered);
 
   return event;
 }
@@ -130,7 +135,7 @@ dump_last_events_to_client(PluginInstance* plugin, ClientPtr client, int n)
 // prints in the Xorg.n.log
 static void
 dump_event(KeyCode key, KeyCode fork, bool press, Time event_time, XkbDescPtr xkb,
-	   XkbSrvInfoPtr xkbi, Time prev_time)
+	   XkbSrvInfoPtr xkbi, Time prev_time, int reason, int hold)
 {
     char* ksname = xkb->names->keys[key].name;
     ErrorF("%d %.4s\n", key, ksname);
@@ -138,6 +143,7 @@ dump_event(KeyCode key, KeyCode fork, bool press, Time event_time, XkbDescPtr xk
     // 0.1   keysym bound to the key:
     KeySym* sym= XkbKeySymsPtr(xkbi->desc,key); // mmc: is this enough ?
     char* sname = NULL;
+    char keysymname[15];
 
     if (sym){
 	sname = XkbKeysymText(*sym,XkbCFile); // doesn't work inside server !!
@@ -146,7 +152,6 @@ dump_event(KeyCode key, KeyCode fork, bool press, Time event_time, XkbDescPtr xk
 	if (! isalpha(* (unsigned char*) sym)){
 	    sym = (KeySym*) " ";
 	} else {
-	    static char keysymname[15];
 	    sprintf(keysymname, "%c", (*sym));
 	    sname = keysymname;
 	};
@@ -160,10 +165,14 @@ dump_event(KeyCode key, KeyCode fork, bool press, Time event_time, XkbDescPtr xk
 
     ErrorF("%s %d (%d)" ,(press?" ]":"[ "),
 	   (int)key, (int) fork);
-    ErrorF(" %.4s (%5.5s) %" TIME_FMT "\t%" TIME_FMT "\n",
+    ErrorF(" %.4s (%5.5s) %" TIME_FMT "\t%" TIME_FMT "\treason %d, held %s%dms\n",
 	   ksname, sname,
 	   event_time,
-	   event_time - prev_time);
+	   event_time - prev_time,
+	   reason,
+	   (hold == 0)? "": ((hold < FORK_HISTOGRAM_BUCKETS - 1)? "< ": ">= "),
+	   (hold == 0)? 0: ((hold < FORK_HISTOGRAM_BUCKETS - 1)?
+			    (1 << hold): (1 << (hold - 1))));
 }
 
 
@@ -185,7 +194,8 @@ public:
                event->forked,
                event->press,
                event->time,
-               xkb, xkbi, previous_time);
+               xkb, xkbi, previous_time,
+               event->reason, event->hold);
     previous_time = event->time;
   };
 
@@ -25,6 +25,9 @@ extern "C" {
 typedef struct {
   InternalEvent* event;
   KeyCode forked; /* if forked to (another keycode), this is the original key */
+  unsigned char outcome;        /* fork_outcome_* */
+  unsigned char reason;         /* reason_* */
+  Time entered;                 /* server time, when it came to ProcessEvent */
 } key_event;
 
 #if 0 // for now from fork_requests.h
@@ -40,7 +43,7 @@ typedef struct
 
 typedef circular_buffer<archived_event*> last_events_type; /* (100) */
 
-extern archived_event* make_archived_events(key_event* ev);
+extern archived_event* make_archived_events(key_event* ev, Time now);
 extern int dump_last_events_to_client(PluginInstance* plugin, ClientPtr client, int n);
 
 void dump_last_events(PluginInstance* plugin);
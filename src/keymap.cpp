@@ -0,0 +1,230 @@
+/*
+   Find, from the XKB keymap, the pairs (fork target, verificator) where the
+   fork cannot change anything: the target is a modifier, which only selects
+   the level, and the verificator's key types don't use it.  E.g. Shift and
+   the function keys.
+
+   The keymap belongs to the main thread (the XKB requests change it there),
+   so it's read only there: a block handler fingerprints it from time to time,
+   and publishes a new analysis when it (or `keymap_mods') changed.
+*/
+
+#include "config.h"
+#include "debug.h"
+
+#include "fork.h"
+#include "keymap.h"
+
+extern "C" {
+#include <xorg/dix.h>
+#include <string.h>
+}
+
+#include <stdlib.h>
+
+
+/* How often (at most) we fingerprint the keymap, ms. */
+#define KEYMAP_CHECK_INTERVAL 500
+
+
+/* FNV-1a */
+static unsigned int
+hash_add(unsigned int hash, unsigned int value)
+{
+    for (int i = 0; i < 4; i++, value >>= 8) {
+        hash ^= (value & 0xff);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/* What of the keymap the analysis depends on.  Field by field: there is
+ * padding in the XKB structures. */
+static unsigned int
+keymap_fingerprint(XkbDescPtr xkb)
+{
+    XkbClientMapPtr map = xkb->map;
+    unsigned int hash = 2166136261u;
+
+    hash = hash_add(hash, xkb->min_key_code);
+    hash = hash_add(hash, xkb->max_key_code);
+    for (int key = xkb->min_key_code; key <= xkb->max_key_code; key++) {
+        XkbSymMapPtr sym_map = map->key_sym_map + key;
+
+        for (int group = 0; group < XkbNumKbdGroups; group++)
+            hash = hash_add(hash, sym_map->kt_index[group]);
+        hash = hash_add(hash, sym_map->group_info);
+        hash = hash_add(hash, map->modmap[key]);
+    }
+
+    hash = hash_add(hash, map->num_types);
+    for (int t = 0; t < map->num_types; t++) {
+        XkbKeyTypePtr type = map->types + t;
+
+        hash = hash_add(hash, type->mods.mask);
+        hash = hash_add(hash, type->num_levels);
+        for (int i = 0; i < type->map_count; i++) {
+            hash = hash_add(hash, type->map[i].active);
+            hash = hash_add(hash, type->map[i].level);
+            hash = hash_add(hash, type->map[i].mods.mask);
+        }
+    }
+    return hash;
+}
+
+
+/* The modifiers which only select the level: those which alone select the
+ * 3rd or the 5th level in some key type (the level3 and level5 shifts). */
+static unsigned int
+keymap_level_mods(XkbDescPtr xkb)
+{
+    unsigned int mods = 0;
+
+    for (int t = 0; t < xkb->map->num_types; t++) {
+        XkbKeyTypePtr type = xkb->map->types + t;
+
+        for (int i = 0; i < type->map_count; i++) {
+            XkbKTMapEntryPtr entry = type->map + i;
+            unsigned int mask = entry->mods.mask;
+
+            if (entry->active && ((entry->level == 2) || (entry->level == 4))
+                && mask && !(mask & (mask - 1)))
+                mods |= mask;
+        }
+    }
+    return (mods & ~(ShiftMask | LockMask));
+}
+
+
+/* Has KEY a Shift level, in all its groups?  If not (arrows, F-keys, Return
+ * ...), the clients bind its chords with the modifiers. */
+static Bool
+key_has_shift_level_p(XkbDescPtr xkb, KeyCode key)
+{
+    for (int group = 0; group < XkbKeyNumGroups(xkb, key); group++) {
+        XkbKeyTypePtr type = XkbKeyKeyType(xkb, key, group);
+        if (!(type->mods.mask & ShiftMask))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* Do the modifiers MODS leave the keysyms of KEY intact, in all its groups? */
+static Bool
+key_ignores_mods_p(XkbDescPtr xkb, KeyCode key, unsigned int mods)
+{
+    for (int group = 0; group < XkbKeyNumGroups(xkb, key); group++) {
+        XkbKeyTypePtr type = XkbKeyKeyType(xkb, key, group);
+        if (type->mods.mask & mods)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+
+static void
+keymap_analyse(keymap_analysis* analysis, XkbDescPtr xkb, unsigned int mods)
+{
+    Bool automatic = (mods == FORK_KEYMAP_MODS_AUTO);
+
+    analysis->mods = (automatic? keymap_level_mods(xkb) : mods);
+    DB(("%s: analysing the keymap for modifiers 0x%x\n", __FUNCTION__,
+        analysis->mods));
+
+    memset(analysis->no_fork, 0, sizeof(analysis->no_fork));
+    if (!analysis->mods)
+        return;
+
+    for (int target = xkb->min_key_code; target <= xkb->max_key_code; target++) {
+        unsigned int target_mods = xkb->map->modmap[target];
+
+        /* not a modifier, or one with some other meaning (Control ...) */
+        if (!target_mods || (target_mods & ~analysis->mods))
+            continue;
+
+        for (int key = xkb->min_key_code; key <= xkb->max_key_code; key++)
+            if (key_ignores_mods_p(xkb, key, target_mods)
+                && (!automatic || key_has_shift_level_p(xkb, key)))
+                analysis->no_fork[target][key >> 3] |= (1 << (key & 7));
+    }
+}
+
+
+/* On the main thread, before it sleeps. */
+static void
+keymap_block_handler(pointer data, OSTimePtr timeout, pointer read_mask)
+{
+    PluginInstance* plugin = (PluginInstance*) data;
+    machineRec* machine = plugin_machine(plugin);
+    keymap_watch_state* watch = &machine->keymap_watch;
+    XkbDescPtr xkb = plugin->device->key->xkbInfo->desc;
+    unsigned int mods = machine->config->keymap_mods;
+    Time now = GetTimeInMillis();
+
+    if (watch->made && (mods == watch->mods)
+        && (now - watch->checked < KEYMAP_CHECK_INTERVAL))
+        return;
+
+    watch->checked = now;
+    unsigned int serial = keymap_fingerprint(xkb);
+    if (watch->made && (mods == watch->mods) && (serial == watch->serial))
+        return;
+
+    keymap_analysis* analysis = MALLOC(keymap_analysis);
+    if (!analysis) {
+        ErrorF("%s: malloc failed\n", __FUNCTION__);
+        return;
+    }
+    keymap_analyse(analysis, xkb, mods);
+    watch->made = TRUE;
+    watch->serial = serial;
+    watch->mods = mods;
+
+    // the machine has not taken the previous one, so it's still ours:
+    free(__sync_lock_test_and_set(&watch->published, analysis));
+}
+
+
+static void
+keymap_wakeup_handler(pointer data, int result, pointer read_mask)
+{
+}
+
+
+void
+keymap_start_watching(PluginInstance* plugin)
+{
+    RegisterBlockAndWakeupHandlers(keymap_block_handler, keymap_wakeup_handler,
+                                   (pointer) plugin);
+}
+
+
+void
+keymap_stop_watching(PluginInstance* plugin)
+{
+    RemoveBlockAndWakeupHandlers(keymap_block_handler, keymap_wakeup_handler,
+                                 (pointer) plugin);
+}
+
+
+void
+keymap_adopt(machineRec* machine)
+{
+    keymap_analysis* analysis = __sync_lock_test_and_set(&machine->keymap_watch.published,
+                                                         (keymap_analysis*) NULL);
+    if (analysis) {
+        free(machine->keymap);
+        machine->keymap = analysis;
+    }
+}
+
+
+void
+keymap_free(machineRec* machine)
+{
+    free(machine->keymap);
+    free(machine->keymap_watch.published);
+    machine->keymap = machine->keymap_watch.published = NULL;
+}
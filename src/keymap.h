@@ -0,0 +1,27 @@
+#ifndef _KEYMAP_H_
+#define _KEYMAP_H_
+
+#include "fork.h"
+
+extern "C" {
+#include <xorg/xkbsrv.h>
+}
+
+/* The analysis is made on the main thread, in a block handler: when the
+ * keymap (or `keymap_mods') changes, a new one is published, and the machine
+ * adopts it at its next step. */
+extern void keymap_start_watching(PluginInstance* plugin);
+extern void keymap_stop_watching(PluginInstance* plugin);
+
+/* By the machine: take the analysis published, if any. */
+extern void keymap_adopt(machineRec* machine);
+extern void keymap_free(machineRec* machine);
+
+/* Does forking to TARGET make no difference for the keysyms of VERIFICATOR? */
+inline Bool
+keymap_no_fork_p(const keymap_analysis* analysis, KeyCode target, KeyCode verificator)
+{
+    return (analysis->no_fork[target][verificator >> 3] & (1 << (verificator & 7)));
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+   Hold-latency histograms.  See latency.h
+*/
+
+#include "config.h"
+#include "debug.h"
+
+#include "fork.h"
+#include "latency.h"
+
+#include <stdlib.h>
+#include <strings.h>
+
+
+latency_state*
+latency_new()
+{
+    latency_state* latency = MALLOC(latency_state);
+
+    if (!latency) {
+        ErrorF("%s: malloc failed, no latency histograms\n", __FUNCTION__);
+        return NULL;
+    }
+    bzero(latency, sizeof(latency_state));
+    return latency;
+}
+
+
+void
+latency_free(machineRec* machine)
+{
+    free(machine->latency);
+    machine->latency = NULL;
+}
+
+
+int
+latency_histogram_count(const latency_state* latency, int type, int selector,
+                        int bucket)
+{
+    if ((bucket < 0) || (bucket >= FORK_HISTOGRAM_BUCKETS) || (selector < 0))
+        return 0;
+
+    switch (type) {
+    case fork_configure_hold_histogram:
+        if (selector < MAX_KEYCODE)
+            return latency->by_key[selector].count[bucket];
+        break;
+    case fork_configure_outcome_histogram:
+        if (selector < fork_outcome_count)
+            return latency->by_outcome[selector].count[bucket];
+        break;
+    case fork_configure_state_histogram:
+        if (selector < 2)
+            return latency->by_state[selector].count[bucket];
+        break;
+    case fork_configure_timer_histogram:
+        if (selector < 2)
+            return latency->timer_late[selector].count[bucket];
+        break;
+    }
+    return 0;
+}
+
+
+void
+latency_reset(latency_state* latency)
+{
+    bzero(latency, sizeof(latency_state));
+}
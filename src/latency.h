@@ -0,0 +1,95 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include "fork.h"
+#include "event_ops.h"
+
+/* Hold latency: how long the events stay in the plugin (from ProcessEvent to
+ * the hand-over to the next plugin, by the server clock), per keycode and per
+ * decision outcome, and how long the suspects stay in st_suspect & st_verify.
+ * And how late the timer wakes us, after the time we asked for.
+ *
+ * The histograms have fixed, log-scaled buckets (see histogram_bucket).  They
+ * are updated without the lock (the client reads & resets them from the main
+ * thread), so a reading may miss a few of the concurrent ones. */
+
+typedef struct
+{
+    unsigned int count[FORK_HISTOGRAM_BUCKETS];
+} histogram;
+
+
+struct latency_state
+{
+    histogram by_key[MAX_KEYCODE];          /* the original keycode */
+    histogram by_outcome[fork_outcome_count];
+    histogram by_state[2];                  /* st_suspect, st_verify */
+    histogram timer_late[2];                /* by the time passed, by the server clock */
+};
+
+
+/* Bucket 0 is 0 ms, bucket B is [2^(B-1), 2^B) ms, the last one takes the rest. */
+inline int
+histogram_bucket(Time ms)
+{
+    if (!ms)
+        return 0;
+    int bucket = 32 - __builtin_clz((unsigned int) ms);
+    return (bucket < FORK_HISTOGRAM_BUCKETS)? bucket : (FORK_HISTOGRAM_BUCKETS - 1);
+}
+
+
+inline void
+histogram_add(histogram* h, Time ms)
+{
+    __sync_fetch_and_add(&h->count[histogram_bucket(ms)], 1);
+}
+
+
+/* EV is being handed over, at NOW. */
+inline void
+latency_note_output(latency_state* latency, const key_event* ev, Time now)
+{
+    const InternalEvent* event = ev->event;
+
+    if (!(press_p(event) || release_p(event)))
+        return;
+
+    Time hold = now - ev->entered;
+    histogram_add(&latency->by_key[ev->forked? ev->forked: detail_of(event)], hold);
+    if (press_p(event))
+        histogram_add(&latency->by_outcome[ev->outcome], hold);
+}
+
+
+/* A suspect leaves STATE (st_suspect or st_verify), having been in it for TIME. */
+inline void
+latency_note_state(latency_state* latency, int state, Time time)
+{
+    histogram_add(&latency->by_state[(state == st_verify)? 1: 0], time);
+}
+
+
+/* A time step, at NOW (as passed), CLOCK (the server's), after we asked for
+ * REQUESTED (the server's 0 = none).  An earlier one is not our wakeup, but
+ * the time pushed by the previous plugin. */
+inline void
+latency_note_wakeup(latency_state* latency, Time requested, Time now, Time clock)
+{
+    if (!requested || (now < requested))
+        return;
+    histogram_add(&latency->timer_late[0], now - requested);
+    histogram_add(&latency->timer_late[1], (clock > requested)? (clock - requested): 0);
+}
+
+
+extern latency_state* latency_new();
+extern void latency_free(machineRec* machine);
+
+/* The count in BUCKET of the histogram TYPE (fork_configure_*_histogram),
+ * SELECTOR choosing the one of the kind. */
+extern int latency_histogram_count(const latency_state* latency, int type,
+                                   int selector, int bucket);
+extern void latency_reset(latency_state* latency);
+
+#endif
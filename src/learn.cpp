@@ -0,0 +1,267 @@
+/*
+   Learning mode: tune the per-pair limits (overlap_tolerance,
+   verification_interval) by the outcome of the decisions.  See learn.h
+*/
+
+#include "config.h"
+#include "debug.h"
+
+#include "fork.h"
+#include "configure.h"
+#include "learn.h"
+#include "event_ops.h"
+
+#include <stdlib.h>
+#include <strings.h>
+
+
+static int
+clamp_limit(fork_configuration* config, int value)
+{
+    if (value < config->learn_min)
+        return config->learn_min;
+    if (value > config->learn_max)
+        return config->learn_max;
+    return value;
+}
+
+
+/* Through the usual path, as if the client configured it. */
+static void
+set_pair_limit(PluginInstance* plugin, machineRec* machine, int type,
+               KeyCode suspect, KeyCode verificator, int old_value, int value)
+{
+    if (value == old_value)
+        return;
+
+    int values[5] = {configure_type(type, 2), suspect, verificator, value, 0};
+
+    MDB(("%s: %s of %d/%d: %d -> %d\n", __FUNCTION__,
+         (type == fork_configure_overlap_limit)? "overlap":"total",
+         suspect, verificator, old_value, value));
+    machine_configure_now(plugin, values);
+}
+
+
+/* The fork was right: try to decide it sooner next time. But keep above the
+ * longest non-fork we have seen. */
+static void
+learn_right_fork(PluginInstance* plugin, machineRec* machine,
+                 const learn_decision* decision)
+{
+    fork_configuration* config = machine->config;
+    learn_state* learn = machine->learn;
+    KeyCode s = decision->suspect;
+    KeyCode v = decision->verificator;
+    int step = (config->learn_step / 4)? (config->learn_step / 4) : 1;
+
+    if (decision->reason == reason_overlap) {
+        int limit = overlap_tolerance_of(config, s, v);
+        int floor = learn->overlap_floor[s][v] + config->learn_step;
+        int value = clamp_limit(config, limit - step);
+
+        if (value < floor)
+            value = clamp_limit(config, floor);
+        if (value < limit)
+            set_pair_limit(plugin, machine, fork_configure_overlap_limit, s, v,
+                           limit, value);
+    } else if (decision->reason == reason_total) {
+        int limit = verification_interval_of(config, s, v);
+        int floor = learn->hold_floor[s][v] + config->learn_step;
+        int value = clamp_limit(config, limit - step);
+
+        if (value < floor)
+            value = clamp_limit(config, floor);
+        if (value < limit)
+            set_pair_limit(plugin, machine, fork_configure_total_limit, s, v,
+                           limit, value);
+    }
+}
+
+
+/* The fork was wrong: wait longer. */
+static void
+learn_wrong_fork(PluginInstance* plugin, machineRec* machine,
+                 const learn_decision* decision)
+{
+    fork_configuration* config = machine->config;
+    KeyCode s = decision->suspect;
+    KeyCode v = decision->verificator;
+
+    if (decision->reason == reason_overlap) {
+        int limit = overlap_tolerance_of(config, s, v);
+        set_pair_limit(plugin, machine, fork_configure_overlap_limit, s, v, limit,
+                       clamp_limit(config, limit + config->learn_step));
+    } else if (decision->reason == reason_total) {
+        int limit = verification_interval_of(config, s, v);
+        set_pair_limit(plugin, machine, fork_configure_total_limit, s, v, limit,
+                       clamp_limit(config, limit + config->learn_step));
+    }
+    /* The other reasons are not decided by these limits. */
+}
+
+
+/* Not forking was right: remember what was still a non-fork, and keep the
+ * limits above it. */
+static void
+learn_right_non_fork(PluginInstance* plugin, machineRec* machine,
+                     const learn_decision* decision)
+{
+    fork_configuration* config = machine->config;
+    learn_state* learn = machine->learn;
+    KeyCode s = decision->suspect;
+    KeyCode v = decision->verificator;
+
+    if (decision->hold > learn->hold_floor[s][v])
+        learn->hold_floor[s][v] = decision->hold;
+
+    int limit = verification_interval_of(config, s, v);
+    int value = clamp_limit(config, learn->hold_floor[s][v] + config->learn_step);
+    if (value > limit)
+        set_pair_limit(plugin, machine, fork_configure_total_limit, s, v, limit, value);
+
+    if (!v)
+        return;
+
+    if (decision->overlap > learn->overlap_floor[s][v])
+        learn->overlap_floor[s][v] = decision->overlap;
+
+    limit = overlap_tolerance_of(config, s, v);
+    value = clamp_limit(config, learn->overlap_floor[s][v] + config->learn_step);
+    if (value > limit)
+        set_pair_limit(plugin, machine, fork_configure_overlap_limit, s, v, limit, value);
+}
+
+
+/* We should have forked: decide sooner. With a verificator, it's the overlap
+ * which was too short. */
+static void
+learn_wrong_non_fork(PluginInstance* plugin, machineRec* machine,
+                     const learn_decision* decision)
+{
+    fork_configuration* config = machine->config;
+    learn_state* learn = machine->learn;
+    KeyCode s = decision->suspect;
+    KeyCode v = decision->verificator;
+
+    if (v) {
+        int limit = overlap_tolerance_of(config, s, v);
+        int value = clamp_limit(config, limit - config->learn_step);
+
+        if (value <= (int) learn->overlap_floor[s][v])
+            value = clamp_limit(config, learn->overlap_floor[s][v] + 1);
+        if (value < limit)
+            set_pair_limit(plugin, machine, fork_configure_overlap_limit, s, v,
+                           limit, value);
+    } else {
+        int limit = verification_interval_of(config, s, v);
+        int value = clamp_limit(config, limit - config->learn_step);
+
+        if (value <= (int) learn->hold_floor[s][v])
+            value = clamp_limit(config, learn->hold_floor[s][v] + 1);
+        if (value < limit)
+            set_pair_limit(plugin, machine, fork_configure_total_limit, s, v,
+                           limit, value);
+    }
+}
+
+
+static void
+learn_apply(PluginInstance* plugin, machineRec* machine,
+            learn_decision* pending, Bool right)
+{
+    learn_decision decision = *pending;
+
+    pending->pending = FALSE;
+    MDB(("%s: the %s of %d (verificator %d) was %s\n", __FUNCTION__,
+         decision.forked? "fork":"non-fork", decision.suspect, decision.verificator,
+         right? "right":"wrong"));
+
+    if (decision.forked) {
+        if (right)
+            learn_right_fork(plugin, machine, &decision);
+        else
+            learn_wrong_fork(plugin, machine, &decision);
+    } else {
+        if (right)
+            learn_right_non_fork(plugin, machine, &decision);
+        else
+            learn_wrong_non_fork(plugin, machine, &decision);
+    }
+}
+
+
+void
+learn_decided(machineRec* machine, fork_suspect* suspect, Bool forked,
+              int reason, Time now)
+{
+    // the shadow machine must not change the configuration
+    if (!machine->config->learn_step || machine->shadow_p)
+        return;
+
+    if (!machine->learn) {
+        machine->learn = MALLOC(learn_state);
+        if (!machine->learn) {
+            ErrorF("%s: malloc failed, not learning\n", __FUNCTION__);
+            machine->config->learn_step = 0;
+            return;
+        }
+        bzero(machine->learn, sizeof(learn_state));
+    }
+
+    learn_decision* decision = &machine->learn->last;
+
+    /* The previous one has not been undone, before this one. It is applied
+     * by the next learn_judge(). */
+    if (decision->pending)
+        machine->learn->confirmed = *decision;
+
+    decision->pending = TRUE;
+    decision->suspect = suspect->suspect;
+    decision->forked = forked;
+    decision->reason = reason;
+    decision->hold = now - suspect->suspect_time;
+    decision->time = now;
+    decision->verificator = 0;
+    decision->overlap = 0;
+    if (suspect->verificators_count > 0) {
+        decision->verificator = suspect->verificators[0].key;
+        decision->overlap = now - suspect->verificators[0].time;
+    }
+}
+
+
+void
+learn_judge(PluginInstance* plugin, machineRec* machine, const InternalEvent* event)
+{
+    learn_state* learn = machine->learn;
+
+    if (!learn)
+        return;
+
+    if (!machine->config->learn_step) {
+        learn->last.pending = learn->confirmed.pending = FALSE;
+        return;
+    }
+
+    if (learn->confirmed.pending)
+        learn_apply(plugin, machine, &learn->confirmed, TRUE);
+
+    if (!learn->last.pending || !press_p(event))
+        return;
+
+    Time elapsed = time_of(event) - learn->last.time;
+
+    if (elapsed >= LEARN_WINDOW)
+        learn_apply(plugin, machine, &learn->last, TRUE);
+    else if (detail_of(event) == machine->config->learn_undo_key)
+        learn_apply(plugin, machine, &learn->last, FALSE);
+}
+
+
+void
+learn_free(machineRec* machine)
+{
+    free(machine->learn);
+    machine->learn = NULL;
+}
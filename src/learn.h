@@ -0,0 +1,54 @@
+#ifndef _LEARN_H_
+#define _LEARN_H_
+
+#include "fork.h"
+
+/* Learning mode (learn_step > 0): the decisions are judged by what the user
+ * types next, and the limits of the pair (suspect, verificator) are moved --
+ * via machine_configure_now(), within [learn_min, learn_max] -- so that the fork
+ * is decided as soon as it is still safe.
+ *
+ * A decision is wrong, if `learn_undo_key' is pressed within LEARN_WINDOW
+ * after it; it is right, if the window passes (or the next decision comes)
+ * without it. */
+
+#define LEARN_WINDOW 1500       /* ms */
+
+
+/* The decision awaiting its judgement. */
+typedef struct
+{
+    Bool pending;
+    KeyCode suspect;
+    KeyCode verificator;        /* the first one, or 0 */
+    Bool forked;
+    unsigned char reason;       /* reason_* */
+    Time hold;                  /* how long the suspect has been down */
+    Time overlap;               /* how long the verificator has been down (in parallel) */
+    Time time;
+} learn_decision;
+
+
+struct learn_state
+{
+    learn_decision last;
+    learn_decision confirmed;   /* followed by another decision, not undone */
+
+    /* The longest press (overlap) observed in a confirmed non-fork. The limit
+     * is never lowered below it. */
+    Time hold_floor[MAX_KEYCODE][MAX_KEYCODE];
+    Time overlap_floor[MAX_KEYCODE][MAX_KEYCODE];
+};
+
+
+/* SUSPECT has just been decided, at NOW. */
+extern void learn_decided(machineRec* machine, fork_suspect* suspect, Bool forked,
+                          int reason, Time now);
+
+/* Judge the last decision by the (next) event EV. */
+extern void learn_judge(PluginInstance* plugin, machineRec* machine,
+                        const InternalEvent* event);
+
+extern void learn_free(machineRec* machine);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+   The built-in decision policies: how the keys pressed (after the suspect)
+   decide the fork.  See policy.h
+*/
+
+#include "config.h"
+#include "debug.h"
+
+#include "fork.h"
+#include "policy.h"
+
+
+static policy_decision
+never_by_time(machineRec* machine, fork_suspect* suspect, Time now, Time* next,
+              int* reason)
+{
+    *next = NO_DEADLINE;
+    return policy_wait;
+}
+
+
+static policy_decision
+wait_for_verificator(machineRec* machine, fork_suspect* suspect,
+                     fork_verificator* verificator, int* reason)
+{
+    return policy_wait;
+}
+
+
+static policy_decision
+wait_for_release(machineRec* machine, fork_suspect* suspect,
+                 fork_verificator* verificator, Time time, int* reason)
+{
+    return policy_wait;
+}
+
+
+/** fork_policy_overlap: the verificator has to overlap long enough. */
+
+/* The `fork_ratio_before' rule never asks for less overlap than this, ms: keys
+ * pressed in the same ms would fork at once. */
+#define RATIO_MIN_OVERLAP 20
+
+
+/* When the overlap with VERIFICATOR proves the fork. Either the absolute
+ * tolerance, or (if configured, and earlier) relative to the time between the
+ * presses.  REASON is set to the rule giving that time. */
+static Time
+overlap_decision_time(fork_configuration* config, fork_suspect* suspect,
+                      fork_verificator* verificator, int* reason)
+{
+    Time decision_time = verificator->time + verificator->tolerance;
+    *reason = reason_overlap;
+
+    if ((config->overlap_ratio_rule == fork_ratio_before) && config->overlap_ratio) {
+        Time before = verificator->time - suspect->suspect_time;
+        Time overlap = (before * config->overlap_ratio) / 100;
+        Time relative = verificator->time
+            + ((overlap < RATIO_MIN_OVERLAP)? RATIO_MIN_OVERLAP : overlap);
+
+        if (relative < decision_time) {
+            decision_time = relative;
+            *reason = reason_ratio;
+        }
+    }
+    return decision_time;
+}
+
+
+// Any of the verificators (still pressed) can prove it, each with its own tolerance.
+static policy_decision
+key_pressed_in_parallel(machineRec *machine, fork_suspect* suspect, Time current_time,
+                        Time* next, int* reason)
+{
+    Time earliest = NO_DEADLINE;
+
+    for (int i = 0; i < suspect->verificators_count; i++) {
+        fork_verificator* verificator = suspect->verificators + i;
+        int rule;
+        // verify overlap
+        Time decision_time =  overlap_decision_time(machine->config, suspect,
+                                                    verificator, &rule);
+
+        if (decision_time <= current_time) {
+            *reason = rule;
+            return policy_fork;
+        }
+
+        MDB(("suspected = %d, verificator %d. Times: overlap %d, "
+             "still needed: %u (ms)\n", suspect->suspect, verificator->key,
+             current_time - verificator->time,
+             decision_time - current_time));
+
+        if (decision_time < earliest)
+            earliest = decision_time;
+    }
+    *next = earliest;
+    return policy_wait;
+}
+
+
+/* The `fork_ratio_duration' rule: the overlap with the suspect, relative to
+ * the whole press of the verificator.  Only known at its release: */
+static Bool
+duration_ratio_p(const fork_configuration* config)
+{
+    return ((config->policy == fork_policy_overlap)
+            && (config->overlap_ratio_rule == fork_ratio_duration)
+            && config->overlap_ratio);
+}
+
+
+/* VERIFICATOR released at RELEASE_TIME: did its overlap reach the ratio of its
+ * press?  While the suspect is down, the overlap is the whole press.  After
+ * the suspect's release (see fork_ratio_release_deadline) only its part. */
+static policy_decision
+verificator_covered(machineRec* machine, fork_suspect* suspect,
+                    fork_verificator* verificator, Time release_time, int* reason)
+{
+    fork_configuration* config = machine->config;
+
+    if (!duration_ratio_p(config))
+        return policy_wait;
+
+    Time duration = release_time - verificator->time;
+    Time overlap = (suspect->release_ev? suspect->release_time: release_time)
+        - verificator->time;
+    if (overlap * 100 >= duration * config->overlap_ratio) {
+        MDB(("verificator %d released, overlap ratio reached\n", verificator->key));
+        *reason = reason_ratio;
+        return policy_fork;
+    }
+    return policy_wait;
+}
+
+
+/** fork_policy_hold_on_other_press: any key pressed confirms. */
+static policy_decision
+fork_on_press(machineRec* machine, fork_suspect* suspect,
+              fork_verificator* verificator, int* reason)
+{
+    *reason = reason_press;
+    return policy_fork;
+}
+
+
+/** fork_policy_permissive_hold: a key pressed & released inside the suspect. */
+static policy_decision
+fork_on_release(machineRec* machine, fork_suspect* suspect,
+                fork_verificator* verificator, Time time, int* reason)
+{
+    *reason = reason_nested;
+    return policy_fork;
+}
+
+
+/* indexed by fork_policy_* */
+static const fork_policy policies[fork_policy_count] = {
+    {"overlap", wait_for_verificator, verificator_covered, key_pressed_in_parallel},
+    {"hold on other key press", fork_on_press, wait_for_release, never_by_time},
+    {"permissive hold", wait_for_verificator, fork_on_release, never_by_time},
+    /* only the total limit (in the machine) forks: */
+    {"tap preferred", wait_for_verificator, wait_for_release, never_by_time},
+};
+
+
+Time
+fork_ratio_release_deadline(const fork_configuration* config, fork_suspect* suspect,
+                            Time time)
+{
+    Time deadline = 0;
+
+    if (!duration_ratio_p(config))
+        return 0;
+
+    for (int i = 0; i < suspect->verificators_count; i++) {
+        fork_verificator* verificator = suspect->verificators + i;
+        Time overlap = time - verificator->time;
+        // the longest press, which still reaches the ratio:
+        Time last = verificator->time + (overlap * 100) / config->overlap_ratio + 1;
+
+        if (last > deadline)
+            deadline = last;
+    }
+    return deadline;
+}
+
+
+const fork_policy*
+fork_policy_of(const fork_configuration* config)
+{
+    if ((config->policy < 0) || (config->policy >= fork_policy_count))
+        return policies;
+    return policies + config->policy;
+}
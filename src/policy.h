@@ -0,0 +1,51 @@
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+#include "fork.h"
+
+/* What a policy answers: */
+typedef enum {
+    policy_wait,
+    policy_fork,
+    policy_no_fork
+} policy_decision;
+
+
+/* The decision rule of the automaton.
+ *
+ * The machine handles what is common to all of them: the total limit
+ * (verification_interval), the release and auto-repeat of the suspect, the
+ * pair_decision & keymap rules; and it keeps the list of the verificators
+ * (keys pressed after the suspect, and still down).  The policy is asked only
+ * about the verificators.  REASON is set when deciding a fork. */
+typedef struct
+{
+    const char* name;
+
+    /* VERIFICATOR has just been pressed (at verificator->time). */
+    policy_decision (*verificator_pressed)(machineRec* machine, fork_suspect* suspect,
+                                           fork_verificator* verificator, int* reason);
+
+    /* VERIFICATOR is released at TIME, while the suspect is still down. */
+    policy_decision (*verificator_released)(machineRec* machine, fork_suspect* suspect,
+                                            fork_verificator* verificator, Time time,
+                                            int* reason);
+
+    /* At NOW: decide, or set *NEXT to the time, when the time alone could
+     * decide (NO_DEADLINE = never). It must not decide before that time. */
+    policy_decision (*by_time)(machineRec* machine, fork_suspect* suspect, Time now,
+                               Time* next, int* reason);
+} fork_policy;
+
+
+/* The suspect is released at TIME, while its verificators are down.  Under
+ * the `fork_ratio_duration' rule, their releases decide (verificator_released,
+ * with the suspect's `release_ev' set): returns the time after which none of
+ * them can fork any more.  0 if the rule is not used: the release decides. */
+extern Time fork_ratio_release_deadline(const fork_configuration* config,
+                                        fork_suspect* suspect, Time time);
+
+/* The policy selected by the configuration (fork_policy_*). */
+extern const fork_policy* fork_policy_of(const fork_configuration* config);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#include "config.h"
+
+/* Static (USDT) probes of the provider `fork', see doc/probes.
+ * Without <sys/sdt.h> (USE_PROBES = 0) they are nothing; with it, a probe not
+ * attached is a single nop. The MACHINE identifies the keyboard. */
+
+#if USE_PROBES
+#include <sys/sdt.h>
+
+#define PROBE_EVENT_IN(machine, key, type, time) \
+    DTRACE_PROBE4(fork, event_in, machine, key, type, time)
+#define PROBE_STATE(machine, key, old_state, new_state) \
+    DTRACE_PROBE4(fork, state, machine, key, old_state, new_state)
+#define PROBE_SUSPECT(machine, key, time) \
+    DTRACE_PROBE3(fork, suspect, machine, key, time)
+#define PROBE_DECISION(machine, key, forked, reason, hold) \
+    DTRACE_PROBE5(fork, decision, machine, key, forked, reason, hold)
+#define PROBE_EVENT_OUT(machine, key, type, held) \
+    DTRACE_PROBE4(fork, event_out, machine, key, type, held)
+#define PROBE_THAW(machine, time, deferred) \
+    DTRACE_PROBE3(fork, thaw, machine, time, deferred)
+#define PROBE_FORCE(machine, key, reason) \
+    DTRACE_PROBE3(fork, force, machine, key, reason)
+#define PROBE_CONFIG_SWITCH(machine, old_id, new_id) \
+    DTRACE_PROBE3(fork, config_switch, machine, old_id, new_id)
+
+#else  /* USE_PROBES */
+#define PROBE_EVENT_IN(machine, key, type, time) do { ; } while (0)
+#define PROBE_STATE(machine, key, old_state, new_state) do { ; } while (0)
+#define PROBE_SUSPECT(machine, key, time) do { ; } while (0)
+#define PROBE_DECISION(machine, key, forked, reason, hold) do { ; } while (0)
+#define PROBE_EVENT_OUT(machine, key, type, held) do { ; } while (0)
+#define PROBE_THAW(machine, time, deferred) do { ; } while (0)
+#define PROBE_FORCE(machine, key, reason) do { ; } while (0)
+#define PROBE_CONFIG_SWITCH(machine, old_id, new_id) do { ; } while (0)
+#endif /* USE_PROBES */
+
+#endif
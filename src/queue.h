@@ -29,6 +29,7 @@ class my_queue
 {
 private:
     slist<T*> list;
+    int m_length;           // slist::size() walks the list
     const char* m_name;     // for debug string
     typename slist<T*>::iterator last_node;
 
@@ -66,7 +67,7 @@ public:
                 m_name = NULL;
             }
         }
-    my_queue<T>(const char* name = NULL) : m_name(name)
+    my_queue<T>(const char* name = NULL) : m_length(0), m_name(name)
         {
             DB(("constructor\n"));
             last_node = list.end();
@@ -78,6 +79,7 @@ public:
             temp = last_node;
 
             list.swap(peer.list);
+            std::swap(m_length, peer.m_length);
 
             // iter_swap(last_node,peer.last_node);
             if (list.empty())
@@ -98,7 +100,7 @@ public:
 template<typename T>
 int my_queue<T>::length () const
 {
-    return list.size();
+    return m_length;
 };
 
 template<typename T>
@@ -120,6 +122,7 @@ void my_queue<T>::push (T* value)
         list.push_front(value);
         last_node = list.begin();
     }
+    m_length++;
 }
 
 template<typename T>
@@ -136,6 +139,7 @@ T* my_queue<T>::pop ()
     T* pointer = list.front();
 
     list.pop_front();
+    m_length--;
     // invalidate iterators
     if (list.empty())
         last_node = list.begin();
@@ -164,6 +168,8 @@ void my_queue<T>::slice (my_queue<T> &suffix)
         list.splice_after(last_node,
                           suffix.list);
         last_node=suffix.last_node;
+        m_length += suffix.m_length;
+        suffix.m_length = 0;
     }
 #if DEBUG > 1
     DB(("%s now has %d\n", get_name(), length()));
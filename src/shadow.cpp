@@ -0,0 +1,136 @@
+/*
+   Shadow mode: compare the decisions of a candidate configuration with the
+   live ones.  See shadow.h
+*/
+
+#include "config.h"
+#include "debug.h"
+
+#include "fork.h"
+#include "shadow.h"
+#include "event_ops.h"
+
+#include <stdlib.h>
+#include <strings.h>
+
+
+/* The end of the shadow pipeline: never frozen, drops everything. */
+static void
+sink_process_event(PluginInstance* plugin, InternalEvent *event, Bool owner)
+{
+    if (owner)
+        free(event);
+}
+
+
+static void
+sink_process_time(PluginInstance* plugin, Time now)
+{
+}
+
+
+void
+shadow_init(struct shadow_state* shadow, PluginInstance* live, machineRec* machine)
+{
+    bzero(shadow, sizeof(struct shadow_state));
+
+    shadow->live = (machineRec*) live->data;
+    shadow->machine = machine;
+
+    shadow->sink_class.name = "fork-shadow-sink";
+    shadow->sink_class.ProcessEvent = sink_process_event;
+    shadow->sink_class.ProcessTime = sink_process_time;
+
+    shadow->sink.pclass = &shadow->sink_class;
+    shadow->sink.device = live->device;
+    shadow->sink.frozen = FALSE;
+    shadow->sink.prev = &shadow->plugin;
+
+    shadow->plugin.pclass = live->pclass;
+    shadow->plugin.device = live->device;
+    shadow->plugin.frozen = FALSE;
+    shadow->plugin.data = (void*) machine;
+    shadow->plugin.next = &shadow->sink;
+    shadow->plugin.prev = NULL;
+    shadow->plugin.wakeup_time = 0;
+
+    machine->shadow = shadow;
+    machine->shadow_p = TRUE;
+    machine->plugin = &shadow->plugin;
+}
+
+
+static void
+compare(struct shadow_state* shadow, const shadow_record* live,
+        const shadow_record* candidate)
+{
+    shadow->compared++;
+    if (live->out != candidate->out)
+        shadow->disagreements++;
+    shadow->latency_difference += (long long) candidate->latency - live->latency;
+}
+
+
+/* Drop the first N records of SIDE. They will never be matched. */
+static void
+drop_records(struct shadow_state* shadow, shadow_side* side, int n)
+{
+    shadow->unmatched += n;
+    side->count -= n;
+    for (int i = 0; i < side->count; i++)
+        side->records[i] = side->records[i + n];
+}
+
+
+void
+shadow_note_decided(machineRec* machine, const key_event* ev)
+{
+    struct shadow_state* shadow = machine->shadow;
+    const InternalEvent* event = ev->event;
+
+    if (!press_p(event))
+        return;
+
+    shadow_record record;
+    record.time = time_of(event);
+    record.out = detail_of(event);
+    record.key = ev->forked? ev->forked: record.out;
+    record.latency = machine->current_time - record.time;
+
+    int mine = machine->shadow_p? 1: 0;
+    shadow_side* side = shadow->sides + mine;
+    shadow_side* other = shadow->sides + (1 - mine);
+
+    for (int i = 0; i < other->count; i++)
+        if ((other->records[i].time == record.time)
+            && (other->records[i].key == record.key)) {
+            if (mine)
+                compare(shadow, other->records + i, &record);
+            else
+                compare(shadow, &record, other->records + i);
+            /* the older ones were decided by one side only (discarded by
+             * the other). */
+            drop_records(shadow, other, i + 1);
+            shadow->unmatched--;
+            return;
+        }
+
+    if (side->count == SHADOW_RECORDS)
+        drop_records(shadow, side, 1);
+    side->records[side->count++] = record;
+}
+
+
+int
+shadow_latency_difference(const struct shadow_state* shadow)
+{
+    return shadow->compared? (int) (shadow->latency_difference / shadow->compared): 0;
+}
+
+
+void
+shadow_reset_counters(struct shadow_state* shadow)
+{
+    shadow->compared = shadow->disagreements = shadow->unmatched = 0;
+    shadow->latency_difference = 0;
+}
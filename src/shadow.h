@@ -0,0 +1,61 @@
+#ifndef _SHADOW_H_
+#define _SHADOW_H_
+
+#include "fork.h"
+
+/* Shadow mode: a candidate configuration is run by a second machine, on the
+ * same input.  Its output is not emitted, only compared with the live one:
+ * the presses are matched (by time & keycode), and we count, how many were
+ * decided differently, and the difference of the hold latency (how long the
+ * press waited for the decision). */
+
+#define SHADOW_RECORDS 32       /* presses waiting to be matched, per side */
+
+
+typedef struct
+{
+    Time time;                  /* of the press */
+    KeyCode key;                /* as pressed */
+    KeyCode out;                /* as decided (forked or not) */
+    Time latency;               /* from the press to the decision */
+} shadow_record;
+
+
+typedef struct
+{
+    shadow_record records[SHADOW_RECORDS];
+    int count;
+} shadow_side;
+
+
+struct shadow_state
+{
+    machineRec* live;
+    machineRec* machine;        /* the shadow machine */
+
+    PluginInstance plugin;      /* the shadow machine's instance ... */
+    PluginInstance sink;        /* ... its output goes here, and is dropped. */
+    DevicePluginRec sink_class;
+
+    shadow_side sides[2];       /* 0 = live, 1 = shadow */
+
+    unsigned int compared;
+    unsigned int disagreements;
+    unsigned int unmatched;
+    long long latency_difference; /* sum of (shadow - live), ms */
+};
+
+
+/* Prepare the SHADOW, to run MACHINE next to the LIVE plugin. */
+extern void shadow_init(struct shadow_state* shadow, PluginInstance* live,
+                        machineRec* machine);
+
+/* EV has been decided by MACHINE (either one). */
+extern void shadow_note_decided(machineRec* machine, const key_event* ev);
+
+/* The average difference of the hold latency, ms (shadow - live). */
+extern int shadow_latency_difference(const struct shadow_state* shadow);
+
+extern void shadow_reset_counters(struct shadow_state* shadow);
+
+#endif
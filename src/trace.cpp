@@ -0,0 +1,147 @@
+/*
+   The trace ring: binary records of the machine, formatted later.  See trace.h
+*/
+
+#include "config.h"
+#include "debug.h"
+
+#include "fork.h"
+#include "trace.h"
+
+extern "C" {
+#include <xorg/dix.h>
+#include <xorg/xkbsrv.h>
+}
+
+#include <stdlib.h>
+#include <strings.h>
+
+
+extern char const *reason_description[];
+extern char const *state_description[];
+
+
+static const char*
+type_brief(int type)
+{
+    return ((type == ET_KeyPress)? "down":
+            ((type == ET_KeyRelease)? "up": "??"));
+}
+
+
+static void
+format_record(DeviceIntPtr keybd, const trace_record* record)
+{
+    char* keycode_name = keybd->key->xkbInfo->desc->names->keys[record->key].name;
+
+    switch (record->kind) {
+    case trace_event_in:
+        ErrorF("%s >>> %d %4.4s %s (%u) @ %u\n", keybd->name, record->key,
+               keycode_name, type_brief(record->a), (unsigned int) record->c,
+               (unsigned int) record->time);
+        break;
+    case trace_state:
+        ErrorF("%s %d %4.4s: %s -> %s @ %u\n", keybd->name, record->key,
+               keycode_name, state_description[record->a],
+               state_description[record->b], (unsigned int) record->time);
+        break;
+    case trace_decision:
+        ErrorF("%s %d %4.4s: %s (by %s) after %dms @ %u\n", keybd->name, record->key,
+               keycode_name, record->a? "forked": "not forked",
+               reason_description[record->b], record->c, (unsigned int) record->time);
+        break;
+    case trace_event_out:
+        ErrorF("%s <<< %d %4.4s %s, held %dms @ %u\n", keybd->name, record->key,
+               keycode_name, type_brief(record->a), record->c,
+               (unsigned int) record->time);
+        break;
+    case trace_thaw:
+        ErrorF("%s thaw%s @ %u\n", keybd->name, record->a? " (deferred)": "",
+               (unsigned int) record->time);
+        break;
+    case trace_force:
+        ErrorF("%s %d %4.4s: forced (by %s) @ %u\n", keybd->name, record->key,
+               keycode_name, reason_description[record->b], (unsigned int) record->time);
+        break;
+    }
+}
+
+
+/* Format what the machine has written. On the main thread, before it sleeps. */
+static void
+trace_block_handler(pointer data, OSTimePtr timeout, pointer read_mask)
+{
+    PluginInstance* plugin = (PluginInstance*) data;
+    machineRec* machine = plugin_machine(plugin);
+    trace_ring* trace = machine->trace;
+
+    if (!trace)
+        return;
+
+    while (trace->tail != trace->head) {
+        __sync_synchronize();
+        trace_record record = trace->records[trace->tail & (TRACE_RECORDS - 1)];
+        __sync_synchronize();
+        trace->tail++;
+        format_record(plugin->device, &record);
+    }
+
+    unsigned int dropped = trace->dropped;
+    if (dropped != trace->dropped_reported) {
+        ErrorF("%s: %u trace records dropped\n", plugin->device->name,
+               dropped - trace->dropped_reported);
+        trace->dropped_reported = dropped;
+    }
+}
+
+
+static void
+trace_wakeup_handler(pointer data, int result, pointer read_mask)
+{
+}
+
+
+void
+trace_start_formatting(PluginInstance* plugin)
+{
+    RegisterBlockAndWakeupHandlers(trace_block_handler, trace_wakeup_handler,
+                                   (pointer) plugin);
+}
+
+
+void
+trace_stop_formatting(PluginInstance* plugin)
+{
+    RemoveBlockAndWakeupHandlers(trace_block_handler, trace_wakeup_handler,
+                                 (pointer) plugin);
+}
+
+
+/* The ring is allocated once, and kept (the machine might be writing). */
+int
+trace_set(PluginInstance* plugin, Bool on)
+{
+    machineRec* machine = plugin_machine(plugin);
+
+    if (on && !machine->trace) {
+        trace_ring* trace = MALLOC(trace_ring);
+        if (!trace) {
+            ErrorF("%s: malloc failed, not tracing\n", __FUNCTION__);
+            return -1;
+        }
+        bzero(trace, sizeof(trace_ring));
+        __sync_synchronize();
+        machine->trace = trace;
+    }
+    if (machine->trace)
+        machine->trace->on = on;
+    return 0;
+}
+
+
+void
+trace_free(machineRec* machine)
+{
+    free(machine->trace);
+    machine->trace = NULL;
+}
@@ -0,0 +1,80 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "fork.h"
+
+/* The trace ring (fork_configure_trace): the machine writes small binary
+ * records, and they are formatted into the log later, on the main thread,
+ * when the server is idle (its block handler).  Unlike `debug', nothing is
+ * formatted on the input path, so it can stay on.
+ *
+ * One writer (the machine) & one reader (the block handler): no lock. When
+ * the ring is full, the records are dropped (& counted). */
+
+#define TRACE_RECORDS 1024      /* a power of 2 */
+
+
+enum {
+    trace_event_in,             /* key, a: event type, c: event time */
+    trace_state,                /* key (the suspect), a: old, b: new state */
+    trace_decision,             /* key, a: forked, b: reason, c: hold */
+    trace_event_out,            /* key, a: event type, c: held (ms) */
+    trace_thaw,                 /* a: deferred */
+    trace_force,                /* key (the suspect), b: reason */
+};
+
+
+typedef struct
+{
+    Time time;                  /* of the machine */
+    unsigned char kind;
+    KeyCode key;
+    unsigned char a;
+    unsigned char b;
+    int c;
+} trace_record;
+
+
+struct trace_ring
+{
+    Bool on;
+    volatile unsigned int head; /* written by the machine ... */
+    volatile unsigned int tail; /* ... read by the block handler */
+    unsigned int dropped;
+    unsigned int dropped_reported; /* the block handler's */
+    unsigned int dropped_base;     /* the machine's: at the last reset */
+    trace_record records[TRACE_RECORDS];
+};
+
+
+inline void
+trace_note(machineRec* machine, int kind, KeyCode key, int a, int b, int c)
+{
+    trace_ring* trace = machine->trace;
+
+    if (!trace || !trace->on)
+        return;
+    if (trace->head - trace->tail >= TRACE_RECORDS) {
+        trace->dropped++;
+        return;
+    }
+
+    trace_record* record = trace->records + (trace->head & (TRACE_RECORDS - 1));
+    record->time = machine->current_time;
+    record->kind = kind;
+    record->key = key;
+    record->a = a;
+    record->b = b;
+    record->c = c;
+    __sync_synchronize();
+    trace->head++;
+}
+
+
+/* Start (ON) or stop tracing. Returns -1 if the ring cannot be allocated. */
+extern int trace_set(PluginInstance* plugin, Bool on);
+extern void trace_start_formatting(PluginInstance* plugin);
+extern void trace_stop_formatting(PluginInstance* plugin);
+extern void trace_free(machineRec* machine);
+
+#endif